@@ -38,6 +38,8 @@ bc_pgfault(struct UTrapframe *utf)
     uint32_t sectno  = ((uint32_t)addr - DISKMAP) / SECTSIZE;
     uint32_t blockno = (sectno / BLKSECTS);
     int r;
+    struct SysBatch calls[2];
+    size_t n = 0;
 
     // Check that the fault was within the block cache region
     if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
@@ -62,9 +64,8 @@ bc_pgfault(struct UTrapframe *utf)
         if(utf->utf_err == T_PGFLT) {
             // someone tried to write to the memory range...
             // we don't really care if the page was dirty or not, it's dirty now.
-            sys_page_map(0, addr, 
-                         0, addr, 
-                         (PTE_P | PTE_U | PTE_W));
+            sysbatch_add(calls, &n, SYS_page_map, 0, (uint32_t) addr,
+                         0, (uint32_t) addr, PTE_P | PTE_U | PTE_W);
 
             BC_DEBUG("Remapped page %x writable\n", blockno);
         } else {
@@ -87,10 +88,9 @@ bc_pgfault(struct UTrapframe *utf)
         if(ide_read(sectno, addr, BLKSECTS) < 0)
           panic("failed to read data from disk..");
 
-        sys_page_map(0, addr, 
-                     0, addr, 
-                     (PTE_P | PTE_U));
-        
+        sysbatch_add(calls, &n, SYS_page_map, 0, (uint32_t) addr,
+                     0, (uint32_t) addr, PTE_P | PTE_U);
+
         BC_DEBUG("Loaded block %x read only\n", blockno);
     }
 
@@ -107,7 +107,10 @@ bc_pgfault(struct UTrapframe *utf)
     if (bitmap && block_is_free(blockno))
     	panic("reading free block %08x\n", blockno);
 
-    sys_env_recovered();
+    // Remap the page and leave the fault in one trap.
+    sysbatch_add(calls, &n, SYS_env_recovered, 0, 0, 0, 0, 0);
+    if ((r = sys_batch(calls, n)) < 0)
+        panic("bc_pgfault: %e", r);
 }
 
 // Flush the contents of the block containing VA out to disk if
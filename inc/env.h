@@ -41,10 +41,23 @@ enum {
 // Special environment types
 enum EnvType {
     ENV_TYPE_USER = 0,
-    ENV_TYPE_IDLE,
     ENV_TYPE_FS,        // File system server
 };
 
+// Anonymous memory regions reserved with sys_region_reserve.  Pages in
+// [er_start, er_end) are allocated and zeroed by the kernel on first touch.
+#define NENVREGION      8
+
+// Scheduling priorities.  Level 0 is the highest; the multi-level
+// feedback queue scheduler moves envs between 0 and ENV_NPRIO-1.
+#define ENV_NPRIO       4
+
+struct EnvRegion {
+    uintptr_t er_start;     // First byte of the region (page aligned)
+    uintptr_t er_end;       // One past the last byte; 0 if the slot is free
+    int er_perm;            // Permissions of the pages faulted in
+};
+
 struct Env {
     struct Trapframe env_tf;    // Saved registers
     struct Env *env_link;       // Next free Env
@@ -55,12 +68,34 @@ struct Env {
     uint32_t env_runs;      // Number of times environment has run
     int env_cpunum;         // The CPU that the env is running on
 
+    // Run queue linkage, maintained by kern/sched.c.  An env is on a
+    // run queue exactly when it is ENV_RUNNABLE.
+    struct Env *env_rq_next;
+    struct Env *env_rq_prev;
+    int env_rq_cpu;         // CPU whose queue holds us, or -1
+    uint32_t env_migrate_runs;  // env_runs when last stolen by another CPU
+    int env_rq_prio;        // Level of the queue that holds us
+    uint32_t env_cpumask;   // CPUs the env may run on, bit n for CPU n
+
+    // Multi-level feedback queue state
+    int env_priority;       // Current level, 0 (highest) to ENV_NPRIO-1
+    int env_prio_base;      // Highest level the env may be boosted to
+    uint32_t env_ticks;     // Timer ticks left in the current quantum
+
     // Address space
     pde_t *env_pgdir;       // Kernel virtual address of page dir
 
     // Exception handling
     void *env_pgfault_upcall;   // Page fault upcall entry point
 
+    // Demand-zero memory
+    struct EnvRegion env_regions[NENVREGION];
+
+    // Memory accounting, kept up to date by kern/pmap.c
+    uint32_t env_nresident;     // User pages mapped (one per PTE)
+    uint32_t env_npgtables;     // Page table pages
+    uint32_t env_nshared;       // Mappings of pages mapped more than once
+
 
     // Lab 4 IPC
     bool env_ipc_recving;       // Env is blocked receiving
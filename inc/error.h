@@ -25,6 +25,8 @@ enum {
     E_NOT_EXEC      = 14,   // File not a valid executable
     E_NOT_SUPP      = 15,   // Operation not supported
 
+    E_TIMEOUT       = 16,   // Timed out waiting
+
     MAXERROR
 };
 
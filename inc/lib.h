@@ -31,6 +31,7 @@ extern const char *binaryname;
 extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct Page pages[];
+extern const volatile struct PmapStat pmstat;
 
 // exit.c
 void    exit(void);
@@ -55,12 +56,25 @@ int sys_page_alloc(envid_t env, void *pg, int perm);
 int sys_page_map(envid_t src_env, void *src_pg,
              envid_t dst_env, void *dst_pg, int perm);
 int sys_page_unmap(envid_t env, void *pg);
+int sys_page_alloc_range(envid_t env, void *va, size_t len, int perm);
+int sys_page_map_range(envid_t src_env, envid_t dst_env, void *va, size_t len,
+                       uint32_t perm);
+int sys_page_unmap_range(envid_t env, void *va, size_t len);
+envid_t sys_fork(void);
 int sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
-int sys_ipc_recv(void *rcv_pg);
+int sys_ipc_recv(void *rcv_pg, uint32_t timeout_us);
 int sys_env_escape_preempt(uint32_t times);
 int sys_env_disable_preempt();
 int sys_env_enable_preempt();
 int sys_env_recovered();
+int sys_region_reserve(envid_t env, void *va, size_t len, int perm);
+int sys_env_set_priority(envid_t env, int prio);
+int sys_env_set_affinity(envid_t env, uint32_t mask);
+int sys_sleep(uint32_t us);
+int sys_batch(struct SysBatch *calls, size_t n);
+void    sysbatch_add(struct SysBatch *calls, size_t *n, uint32_t num,
+             uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+int sysbatch_flush(struct SysBatch *calls, size_t *n);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -78,6 +92,8 @@ sys_exofork(void)
 // ipc.c
 void    ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+                         uint32_t timeout_us);
 envid_t ipc_find_env(enum EnvType type);
 
 // fork.c
@@ -114,6 +114,9 @@
 #define UVPT        (ULIM - PTSIZE)
 // Read-only copies of the Page structures
 #define UPAGES      (UVPT - PTSIZE)
+// Read-only global memory statistics (struct PmapStat), in the last
+// page of the UPAGES window
+#define UPMSTAT     (UVPT - PGSIZE)
 // Read-only copies of the global env structures
 #define UENVS       (UPAGES - PTSIZE)
 
@@ -177,16 +180,46 @@ extern volatile pde_t vpd[];     // VA of current page directory
  * You can map a Page * to the corresponding physical address
  * with page2pa() in kern/pmap.h.
  */
+struct Rmap;
+
 struct Page {
     // Next page on the free list.
     struct Page *pp_link;
+    // Previous block on the same buddy free list, so a free buddy can be
+    // unlinked in constant time when blocks coalesce.
+    struct Page *pp_prev;
 
     // pp_ref is the count of pointers (usually in page table entries)
     // to this page, for pages allocated using page_alloc.
     // Pages allocated at boot time using pmap.c's
     // boot_alloc do not have valid reference count fields.
 
-    uint16_t pp_ref;
+    uint32_t pp_ref;
+
+    // Reverse map: one entry per page_insert()ed mapping of this page,
+    // so every PTE pointing at it can be found (see page_unmap_all).
+    struct Rmap *pp_rmap;
+
+    // For a page directory page, the Env whose address space it is, so
+    // pmap can charge mappings to it.  NULL otherwise.
+    struct Env *pp_env;
+
+    // Buddy allocator state: pp_free is set on the first page of a free
+    // block of 2^pp_order pages that sits on one of the buddy free lists.
+    uint8_t pp_order;
+    uint8_t pp_free;
+};
+
+/*
+ * Global physical memory statistics, mapped read-only at UPMSTAT.
+ * Every physical page is counted in exactly one of ps_free, ps_zeroed
+ * and ps_used.
+ */
+struct PmapStat {
+    uint32_t ps_npages;     // Physical pages in the machine
+    uint32_t ps_free;       // Free pages, including the per-CPU caches
+    uint32_t ps_zeroed;     // Free pages in the pre-zeroed pool
+    uint32_t ps_used;       // Allocated or reserved pages
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -69,6 +69,10 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL    0xE00    // Available for software use
 
+// PTE_COW marks copy-on-write page table entries.
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
+#define PTE_COW      0x800
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 // Note that PTE_SYSCALL also contains the software bits, so
 // DO NOT use it as a synonym for PTE_P | PTE_W | PTE_U.
@@ -91,6 +95,7 @@
 #define CR0_PG        0x80000000    // Paging
 
 #define CR4_PCE        0x00000100    // Performance counter enable
+#define CR4_PGE        0x00000080    // Page Global Enable
 #define CR4_MCE        0x00000040    // Machine Check Enable
 #define CR4_PSE        0x00000010    // Page Size Extensions
 #define CR4_DE        0x00000008    // Debugging Extensions
@@ -126,6 +131,14 @@
 #define FEC_WR        0x2    // Page fault caused by a write
 #define FEC_U        0x4    // Page fault occured while in user mode
 
+// Model specific registers
+#define MSR_IA32_SYSENTER_CS    0x174    // Kernel CS for sysenter
+#define MSR_IA32_SYSENTER_ESP   0x175    // Kernel ESP for sysenter
+#define MSR_IA32_SYSENTER_EIP   0x176    // Kernel EIP for sysenter
+
+// CPUID leaf 1 EDX feature flags
+#define CPUID_FEAT_SEP    0x00000800    // sysenter/sysexit
+
 
 /*
  *
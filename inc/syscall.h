@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
     SYS_cputs = 0,
@@ -19,7 +21,32 @@ enum {
     SYS_ipc_try_send,           // 13
     SYS_ipc_recv,               // 14
     SYS_env_recovered,
+    SYS_region_reserve,         // 16
+    SYS_env_set_priority,       // 17
+    SYS_env_set_affinity,       // 18
+    SYS_sleep,                  // 19
+    SYS_batch,                  // 20
+    SYS_page_alloc_range,       // 21
+    SYS_page_map_range,         // 22
+    SYS_page_unmap_range,       // 23
+    SYS_fork,                   // 24
     NSYSCALLS
 };
 
+// One system call in a sys_batch.
+struct SysBatch {
+    uint32_t sb_num;            // System call number
+    uint32_t sb_flags;          // SB_* flags
+    uint32_t sb_args[5];        // Arguments, as passed in registers
+    int32_t sb_ret;             // Return value, filled in by the kernel
+};
+
+#define SB_STOP         0x1     // Stop the batch if this call fails
+#define SYSBATCH_MAX    128     // Most calls in one sys_batch
+
+// A sys_page_map_range perm that keeps each page's permissions, less
+// the PTE_SYSCALL bits in 'clear', plus those in 'set'.
+#define PERM_UPDATE             0x80000000
+#define PERM_CHANGE(set, clear) (PERM_UPDATE | (clear) << 12 | (set))
+
 #endif /* !JOS_INC_SYSCALL_H */
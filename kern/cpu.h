@@ -10,10 +10,16 @@
 // Maximum number of CPUs
 #define NCPU  8
 
+// Each CPU keeps a small cache of free pages in front of the buddy
+// allocator.  Pages move between the two PGCACHE_BATCH at a time.
+#define PGCACHE_SIZE    32
+#define PGCACHE_BATCH   16
+
 // Values of status in struct Cpu
 enum {
     CPU_UNUSED = 0,
     CPU_STARTED,
+    CPU_HALTED,                     // Idle in sched_halt, without the kernel lock
 };
 
 // Per-CPU state
@@ -22,6 +28,22 @@ struct Cpu {
     volatile unsigned cpu_status;   // The status of the CPU
     struct Env *cpu_env;            // The currently-running environment.
     struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+    struct Page *cpu_pgcache;       // This CPU's cache of free pages
+    unsigned cpu_pgcache_len;       // Number of pages in cpu_pgcache
+    pde_t *cpu_pgdir;               // Page directory loaded in cr3
+    volatile bool cpu_tlb_pending;  // A TLB shootdown is waiting for us
+    int cpu_tlb_batch;              // tlb_batch_begin nesting depth
+    pde_t *cpu_tlb_batch_pgdir;     // Page directory being batched
+    uintptr_t cpu_tlb_batch_start;  // Batched range [start, end)
+    uintptr_t cpu_tlb_batch_end;
+    struct Env *cpu_runq_head[ENV_NPRIO];   // Runnable envs per level,
+    struct Env *cpu_runq_tail[ENV_NPRIO];   //   oldest first
+    unsigned cpu_runq_len;          // Number of envs on all levels
+    unsigned cpu_ticks;             // Timer ticks since the last boost
+    uint64_t cpu_tick_end;          // TSC at which the running env's tick
+                                    //   ends; 0 if none is in progress
+    uint64_t cpu_timer_deadline;    // TSC the LAPIC timer is set for; 0 if idle
+    volatile bool cpu_tickless;     // Running an env with no tick
 };
 
 // Initialized in mpconfig.c
@@ -29,6 +51,8 @@ extern struct Cpu cpus[NCPU];
 extern int ncpu;                    // Total number of CPUs in the system
 extern struct Cpu *bootcpu;         // The boot-strap processor (BSP)
 extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
+extern uint32_t lapic_khz;          // LAPIC timer ticks per millisecond
+extern uint32_t tsc_khz;            // TSC ticks per millisecond
 
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
@@ -40,6 +64,8 @@ void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
+void lapic_timer_arm(uint32_t us);
 void lapic_ipi(int vector);
+void lapic_ipi_dest(int apicid, int vector);
 
 #endif
@@ -13,11 +13,27 @@
 #include <kern/monitor.h>
 #include <kern/sched.h>
 #include <kern/cpu.h>
+#include <kern/timer.h>
 #include <kern/spinlock.h>
 
 struct Env *envs = NULL;        // All environments
 static struct Env *env_free_list;    // Free environment list
 
+// env_lock protects env_free_list.
+static struct spinlock env_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "env_lock"
+#endif
+};
+
+// Each env's address space (its page tables and the counters and
+// regions that go with them) is protected by its own lock, kept here
+// rather than in struct Env because envs[] is visible to user space.
+static struct spinlock env_vm_locks[NENV];
+
+// The timer each env blocks on in sys_sleep and sys_ipc_recv.
+static struct Timer env_timers[NENV];
+
 #define ENVGENSHIFT    12        // >= LOGNENV
 
 // Global descriptor table.
@@ -122,6 +138,9 @@ env_init(void)
     for(i = NENV - 1; i >= 0; i--) {
         envs[i].env_id = 0;
         envs[i].env_status = ENV_FREE;
+        envs[i].env_rq_cpu = -1;
+        __spin_initlock(&env_vm_locks[i], "env_vm_lock");
+        timer_init(&env_timers[i], NULL, NULL);
         envs[i].env_link = env_free_list;
         env_free_list = &envs[i];
     }
@@ -201,6 +220,8 @@ env_setup_vm(struct Env *e)
     e->env_pgdir = (pde_t *) page2kva(p);
     memset(e->env_pgdir, 0, PGSIZE);
     p->pp_ref++;
+    p->pp_env = e;
+    e->env_nresident = e->env_npgtables = e->env_nshared = 0;
 
     // Copy all mappings from kern_pgdir above UTOP
     for(i = PDX(UTOP); i < NPDENTRIES; i++){
@@ -229,13 +250,21 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
     int r;
     struct Env *e;
 
+    spin_lock(&env_lock);
     if (!(e = env_free_list)) {
+        spin_unlock(&env_lock);
         cprintf("[env_alloc] no free envs!\n");
         return -E_NO_FREE_ENV;
     }
+    env_free_list = e->env_link;
+    spin_unlock(&env_lock);
 
     // Allocate and set up the page directory for this environment.
     if ((r = env_setup_vm(e)) < 0) {
+        spin_lock(&env_lock);
+        e->env_link = env_free_list;
+        env_free_list = e;
+        spin_unlock(&env_lock);
         cprintf("[env_alloc] could not initialize environment!\n");
         return r;
     }
@@ -249,8 +278,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
     // Set the basic status variables.
     e->env_parent_id = parent_id;
     e->env_type = ENV_TYPE_USER;
-    e->env_status = ENV_RUNNABLE;
     e->env_runs = 0;
+    e->env_migrate_runs = 0;
+    e->env_prio_base = 0;
+    e->env_cpumask = ~0;
+    sched_set_priority(e, 0);
+    env_set_status(e, ENV_RUNNABLE);
 
     // Clear out all the saved register state,
     // to prevent the register values
@@ -280,17 +313,169 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
     // Clear the page fault handler until user installs one.
     e->env_pgfault_upcall = 0;
 
+    // No demand-zero regions yet.
+    memset(e->env_regions, 0, sizeof(e->env_regions));
+
     // Also clear the IPC receiving flag.
     e->env_ipc_recving = 0;
 
-    // commit the allocation
-    env_free_list = e->env_link;
     *newenv_store = e;
 
     cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
     return 0;
 }
 
+//
+// Record [va, va+len) as a demand-zero region of e: the first access
+// to each unmapped page in it maps a fresh zeroed page with perm.
+// va and len must be page aligned; the caller checks the arguments.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//  -E_INVAL if the range overlaps a region e already has.
+//  -E_NO_MEM if e has no free region slot.
+//
+int
+env_region_reserve(struct Env *e, uintptr_t va, size_t len, int perm)
+{
+    struct EnvRegion *r, *slot = NULL;
+    uintptr_t end = va + len;
+    int res = 0;
+
+    env_vm_lock(e);
+    for (r = e->env_regions; r < e->env_regions + NENVREGION; r++) {
+        if (!r->er_end) {
+            if (!slot)
+                slot = r;
+        } else if (va < r->er_end && r->er_start < end)
+            res = -E_INVAL;
+    }
+    if (!res && !slot)
+        res = -E_NO_MEM;
+
+    if (!res) {
+        slot->er_start = va;
+        slot->er_end = end;
+        slot->er_perm = perm;
+    }
+    env_vm_unlock(e);
+    return res;
+}
+
+//
+// Back the page containing va with a zeroed page, if va lies in one of
+// e's demand-zero regions and nothing is mapped there yet.
+//
+// Returns 0 if a page was mapped, < 0 otherwise.  Errors are:
+//  -E_FAULT if va is not in a region or is already mapped.
+//  -E_NO_MEM if there's no memory for the page or its page table.
+//
+int
+env_region_fault(struct Env *e, uintptr_t va)
+{
+    struct EnvRegion *r;
+    struct Page *pp;
+    int res;
+
+    va = ROUNDDOWN(va, PGSIZE);
+    env_vm_lock(e);
+    for (r = e->env_regions; r < e->env_regions + NENVREGION; r++)
+        if (r->er_start <= va && va < r->er_end)
+            break;
+    if (r == e->env_regions + NENVREGION ||
+        page_lookup(e->env_pgdir, (void *) va, NULL))
+        res = -E_FAULT;
+    else if (!(pp = page_alloc(ALLOC_ZERO)))
+        res = -E_NO_MEM;
+    else if ((res = page_insert(e->env_pgdir, pp, (void *) va,
+                                r->er_perm | PTE_U | PTE_P)) < 0)
+        page_free(pp);
+    env_vm_unlock(e);
+    return res;
+}
+
+//
+// Resolve a write fault at va in e on a copy-on-write page: make the
+// page writable again if no one else maps it, otherwise map a private
+// copy of it in its place.
+//
+// Returns 0 if the fault was resolved, < 0 otherwise.  Errors are:
+//  -E_FAULT if va is not mapped copy-on-write.
+//  -E_NO_MEM if there's no memory for the copy.
+//
+int
+env_cow_fault(struct Env *e, uintptr_t va)
+{
+    struct Page *pp, *copy;
+    pte_t *pte;
+    int perm, res;
+
+    va = ROUNDDOWN(va, PGSIZE);
+    env_vm_lock(e);
+    if (!(pp = page_lookup(e->env_pgdir, (void *) va, &pte)) ||
+        !(*pte & PTE_COW)) {
+        env_vm_unlock(e);
+        return -E_FAULT;
+    }
+    perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+    // Other address spaces can only gain a mapping of pp by copying
+    // one of e's, which needs e's lock, so a count of 1 can't go up.
+    if (pp->pp_ref == 1)
+        res = page_insert(e->env_pgdir, pp, (void *) va, perm);
+    else if (!(copy = page_alloc(0)))
+        res = -E_NO_MEM;
+    else {
+        memmove(page2kva(copy), page2kva(pp), PGSIZE);
+        if ((res = page_insert(e->env_pgdir, copy, (void *) va, perm)) < 0)
+            page_free(copy);
+    }
+    env_vm_unlock(e);
+    return res;
+}
+
+//
+// Lock e's address space.  Anything that changes the page tables of a
+// user env, or its demand-zero regions, must hold this.
+//
+void
+env_vm_lock(struct Env *e)
+{
+    spin_lock(&env_vm_locks[ENVX(e->env_id)]);
+}
+
+void
+env_vm_unlock(struct Env *e)
+{
+    spin_unlock(&env_vm_locks[ENVX(e->env_id)]);
+}
+
+//
+// Lock the address spaces of a and b, which may be the same env.  The
+// locks are always taken in envs[] order so two CPUs locking the same
+// pair cannot deadlock.
+//
+void
+env_vm_lock2(struct Env *a, struct Env *b)
+{
+    if (a == b)
+        env_vm_lock(a);
+    else if (a < b) {
+        env_vm_lock(a);
+        env_vm_lock(b);
+    } else {
+        env_vm_lock(b);
+        env_vm_lock(a);
+    }
+}
+
+void
+env_vm_unlock2(struct Env *a, struct Env *b)
+{
+    env_vm_unlock(a);
+    if (a != b)
+        env_vm_unlock(b);
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -396,7 +581,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
         panic("Invalid ELF image!\n");
     }
 
-    lcr3(PADDR(e->env_pgdir));
+    pmap_load(e->env_pgdir);
 
         struct Proghdr *ph = (struct Proghdr *) (binary + elfhdr->e_phoff);
         struct Proghdr *end = ph + elfhdr->e_phnum;
@@ -411,7 +596,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
         ph++;
     }
 
-    lcr3(PADDR(kern_pgdir));
+    pmap_load(kern_pgdir);
 
     // Now map one page for the program's initial stack
     // at virtual address USTACKTOP - PGSIZE.
@@ -459,13 +644,16 @@ env_free(struct Env *e)
     // before freeing the page directory, just in case the page
     // gets reused.
     if (e == curenv)
-        lcr3(PADDR(kern_pgdir));
+        pmap_load(kern_pgdir);
 
     // Note the environment's demise.
     cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+    timer_cancel(env_timer(e));
 
     // Flush all mapped pages in the user portion of the address space
     static_assert(UTOP % PTSIZE == 0);
+    env_vm_lock(e);
+    tlb_batch_begin(e->env_pgdir);
     for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
         // only look at mapped page tables
@@ -486,16 +674,22 @@ env_free(struct Env *e)
         e->env_pgdir[pdeno] = 0;
         page_decref(pa2page(pa));
     }
+    tlb_batch_end();
+    env_vm_unlock(e);
 
     // free the page directory
     pa = PADDR(e->env_pgdir);
     e->env_pgdir = 0;
+    e->env_npgtables = 0;
+    pa2page(pa)->pp_env = NULL;
     page_decref(pa2page(pa));
 
     // return the environment to the free list
-    e->env_status = ENV_FREE;
+    env_set_status(e, ENV_FREE);
+    spin_lock(&env_lock);
     e->env_link = env_free_list;
     env_free_list = e;
+    spin_unlock(&env_lock);
 }
 
 //
@@ -510,7 +704,7 @@ env_destroy(struct Env *e)
     // ENV_DYING. A zombie environment will be freed the next time
     // it traps to the kernel.
     if (e->env_status == ENV_RUNNING && curenv != e) {
-        e->env_status = ENV_DYING;
+        env_set_status(e, ENV_DYING);
         return;
     }
 
@@ -523,6 +717,33 @@ env_destroy(struct Env *e)
 }
 
 
+//
+// Change e's status, keeping the run queues in step: an env is queued
+// when it becomes ENV_RUNNABLE and taken off its queue when it leaves
+// that state.  Every env_status transition after env_init goes through
+// here.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+    if (status == ENV_RUNNABLE) {
+        // However it was woken, it is no longer waiting for its timer.
+        timer_cancel(&env_timers[ENVX(e->env_id)]);
+        sched_enqueue(e);
+    } else
+        sched_dequeue(e);
+    e->env_status = status;
+}
+
+//
+// The timer e blocks on.
+//
+struct Timer *
+env_timer(struct Env *e)
+{
+    return &env_timers[ENVX(e->env_id)];
+}
+
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
 // This exits the kernel and starts executing some environment's code.
@@ -577,15 +798,24 @@ env_run(struct Env *e)
            (e->env_status == ENV_RUNNING));
 
     if (curenv == NULL || curenv->env_id != e->env_id) { // context switch!
-        if (curenv) {
-            if(curenv->env_status != ENV_NOT_RUNNABLE)
-              curenv->env_status = ENV_RUNNABLE;
-        }
+        if (curenv && curenv->env_status == ENV_RUNNING)
+            env_set_status(curenv, ENV_RUNNABLE);
         curenv = e;
-        curenv->env_status = ENV_RUNNING;
         curenv->env_runs++;
-        lcr3(PADDR(curenv->env_pgdir));
+        // A new env gets a whole tick.
+        thiscpu->cpu_tick_end = 0;
     }
+    // Takes e off its run queue, so sched_tick_start counts only the
+    // envs that would be waiting behind it.
+    env_set_status(curenv, ENV_RUNNING);
+    // Returning from a system call doesn't restart the tick, or an env
+    // could dodge preemption by making them.
+    if (!thiscpu->cpu_tick_end)
+        sched_tick_start();
+    sched_timer_arm();
+    // Also covers a CPU that switched to kern_pgdir while halted.
+    if (thiscpu->cpu_pgdir != curenv->env_pgdir)
+        pmap_load(curenv->env_pgdir);
 
     unlock_kernel();
     env_pop_tf(&curenv->env_tf);
@@ -16,8 +16,17 @@ int     env_alloc(struct Env **e, envid_t parent_id);
 void    env_free(struct Env *e);
 void    env_create(uint8_t *binary, size_t size, enum EnvType type);
 void    env_destroy(struct Env *e);    // Does not return if e == curenv
+void    env_set_status(struct Env *e, unsigned status);
+void    env_vm_lock(struct Env *e);
+void    env_vm_unlock(struct Env *e);
+void    env_vm_lock2(struct Env *a, struct Env *b);
+void    env_vm_unlock2(struct Env *a, struct Env *b);
+struct Timer *env_timer(struct Env *e);
 int     env_free_list_len();
 int     envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int     env_region_reserve(struct Env *e, uintptr_t va, size_t len, int perm);
+int     env_region_fault(struct Env *e, uintptr_t va);
+int     env_cow_fault(struct Env *e, uintptr_t va);
 // The following two functions do not return
 void    env_run(struct Env *e) __attribute__((noreturn));
 void    env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -56,11 +56,6 @@ i386_init(void)
     // Starting non-boot CPUs
     boot_aps();
 
-    // Should always have idle processes at first.
-    int i;
-    for (i = 0; i < NCPU; i++)
-        ENV_CREATE(user_idle, ENV_TYPE_IDLE);
-
     // Start fs.
     ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -117,7 +112,8 @@ void
 mp_main(void)
 {
     // We are in high EIP now, safe to switch to kern_pgdir 
-    lcr3(PADDR(kern_pgdir));
+    pmap_load(kern_pgdir);
+    lcr4(rcr4() | CR4_PGE);
     cprintf("SMP: CPU %d starting\n", cpunum());
 
     lapic_init();
@@ -32,6 +32,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
     #define X1         0x0000000B   // divide counts by 1
+    #define ONESHOT    0x00000000   // One-shot
     #define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -42,8 +43,25 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+// 8253/8254 programmable interval timer, channel 2 of which is gated
+// through the keyboard controller's port B.  We use it once, at boot, as
+// a known clock to time the LAPIC timer and the TSC against.
+#define PIT_CH2     0x42
+#define PIT_CTL     0x43
+    #define PIT_CH2_ONESHOT 0xB0    // Channel 2, lo/hi byte, mode 0
+#define PIT_GATE    0x61
+    #define PIT_GATE_EN     0x01    // Channel 2 counts while set
+    #define PIT_GATE_SPKR   0x02    // Channel 2 drives the speaker
+    #define PIT_GATE_OUT    0x20    // Channel 2 output; set at terminal count
+#define PIT_HZ      1193182
+
+#define CALIBRATE_MS        10
+#define CALIBRATE_SPINS     (1 << 24)   // Give up on a missing PIT
+
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
+uint32_t lapic_khz;          // Initialized by lapic_calibrate
+uint32_t tsc_khz;
 
 static void
 lapicw(int index, int value)
@@ -52,6 +70,50 @@ lapicw(int index, int value)
     lapic[ID];  // wait for write to finish, by reading
 }
 
+//
+// Measure how fast the LAPIC timer and the TSC tick by counting both
+// for CALIBRATE_MS according to the PIT.  All CPUs share a bus clock,
+// so the boot CPU does this once for everybody.
+//
+static void
+lapic_calibrate(void)
+{
+    uint32_t count = PIT_HZ / 1000 * CALIBRATE_MS, left, spins;
+    uint64_t tsc;
+    uint8_t gate;
+
+    // Load the PIT with the gate closed and the speaker disconnected.
+    gate = inb(PIT_GATE) & ~(PIT_GATE_EN | PIT_GATE_SPKR);
+    outb(PIT_GATE, gate);
+    outb(PIT_CTL, PIT_CH2_ONESHOT);
+    outb(PIT_CH2, count & 0xFF);
+    outb(PIT_CH2, count >> 8);
+
+    lapicw(TDCR, X1);
+    lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+    lapicw(TICR, 0xFFFFFFFF);
+    tsc = read_tsc();
+    outb(PIT_GATE, gate | PIT_GATE_EN);
+
+    for (spins = 0; spins < CALIBRATE_SPINS; spins++)
+        if (inb(PIT_GATE) & PIT_GATE_OUT)
+            break;
+    left = lapic[TCCR];
+    tsc = read_tsc() - tsc;
+    lapicw(TICR, 0);
+    outb(PIT_GATE, gate);
+
+    if (spins == CALIBRATE_SPINS) {
+        // Assume QEMU's 1GHz APIC bus, and the same for the TSC.
+        cprintf("lapic: no PIT, timer calibration guessed\n");
+        lapic_khz = tsc_khz = 1000000;
+        return;
+    }
+    lapic_khz = (0xFFFFFFFF - left) / CALIBRATE_MS;
+    tsc_khz = tsc / CALIBRATE_MS;
+    cprintf("lapic: timer %u kHz, TSC %u kHz\n", lapic_khz, tsc_khz);
+}
+
 void
 lapic_init(void)
 {
@@ -65,13 +127,14 @@ lapic_init(void)
     // Enable local APIC; set spurious interrupt vector.
     lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-    // The timer repeatedly counts down at bus frequency
-    // from lapic[TICR] and then issues an interrupt.  
-    // If we cared more about precise timekeeping,
-    // TICR would be calibrated using an external time source.
+    // The timer counts down once at bus frequency from lapic[TICR]
+    // and then issues an interrupt.  It stays idle until env_run arms
+    // it with lapic_timer_arm.
+    if (!lapic_khz)
+        lapic_calibrate();
     lapicw(TDCR, X1);
-    lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-    lapicw(TICR, 10000000); 
+    lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+    lapicw(TICR, 0);
 
     // Leave LINT0 of the BSP enabled so that it can get
     // interrupts from the 8259A chip.
@@ -127,11 +190,28 @@ lapic_eoi(void)
         lapicw(EOI, 0);
 }
 
+// Interrupt this CPU once, us microseconds from now.  Replaces any
+// interrupt already pending.
+void
+lapic_timer_arm(uint32_t us)
+{
+    uint64_t ticks;
+
+    if (!lapic)
+        return;
+    ticks = (uint64_t) us * lapic_khz / 1000;
+    lapicw(TICR, MAX(MIN(ticks, 0xFFFFFFFF), 1));
+}
+
 // Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
 static void
 microdelay(int us)
 {
+    uint64_t end;
+
+    end = read_tsc() + (uint64_t) us * tsc_khz / 1000;
+    while (read_tsc() < end)
+        asm volatile ("pause");
 }
 
 #define IO_RTC  0x70
@@ -180,3 +260,13 @@ lapic_ipi(int vector)
     while (lapic[ICRLO] & DELIVS)
         ;
 }
+
+// Send an interrupt to the single CPU with local APIC ID apicid.
+void
+lapic_ipi_dest(int apicid, int vector)
+{
+    lapicw(ICRHI, apicid << 24);
+    lapicw(ICRLO, FIXED | vector);
+    while (lapic[ICRLO] & DELIVS)
+        ;
+}
@@ -15,6 +15,8 @@
 #include <kern/trap.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
+#include <kern/sched.h>
 
 #define CMDBUF_SIZE 80  // enough for one VGA text line
 
@@ -37,7 +39,11 @@ static struct Command commands[] = {
     { "dumppmemory",  "Dump memory in PA range. Args: begin, end",                            mon_dumppmemory   },
     { "si",           "Step broken user program by one instruction",                          mon_si            },
     { "pc",           "Looks up the trap'd PC in the symbol table",                           mon_pc            },
-    { "bt",           "Prints the backtrace associated with the trap frame",                  mon_backtrace     }
+    { "bt",           "Prints the backtrace associated with the trap frame",                  mon_backtrace     },
+    { "zeropool",     "Display pre-zeroed page pool statistics",                              mon_zeropool      },
+    { "memstat",      "Display physical memory use, globally and per environment",            mon_memstat       },
+    { "lockstat",     "Display the most contended spinlocks. Arg: reset to clear counters",   mon_lockstat      },
+    { "quantum",      "Display or set the scheduler tick in microseconds. Arg: [us]",         mon_quantum       }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 #define EIP (*(int*)(ebp+0x1))
@@ -71,6 +77,90 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
     return 0;
 }
 
+int
+mon_zeropool(int argc, char **argv, struct Trapframe *tf)
+{
+    struct PageZeroStats st;
+
+    page_zero_pool_stats(&st);
+    cprintf("zero pool: %u/%u pages, %u filled by idle CPUs\n",
+        st.pzs_len, PAGE_ZERO_POOL_SIZE, st.pzs_filled);
+    cprintf("ALLOC_ZERO: %u hits, %u misses\n", st.pzs_hits, st.pzs_misses);
+    return 0;
+}
+
+int
+mon_memstat(int argc, char **argv, struct Trapframe *tf)
+{
+    struct Env *e;
+
+    cprintf("pages: %u total, %u free, %u zeroed, %u used\n",
+        pmstat->ps_npages, pmstat->ps_free, pmstat->ps_zeroed, pmstat->ps_used);
+    cprintf("env       resident  pgtables  shared\n");
+    for (e = envs; e < envs + NENV; e++) {
+        if (e->env_status == ENV_FREE || !e->env_pgdir)
+            continue;
+        cprintf("%08x  %8u  %8u  %6u\n", e->env_id,
+            e->env_nresident, e->env_npgtables, e->env_nshared);
+    }
+    return 0;
+}
+
+#define LOCKSTAT_TOP 10
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef LOCKSTAT
+    struct spinlock *locks[LOCKSTAT_TOP], *lk;
+    struct Eipdebuginfo info;
+    uint64_t acq;
+    int i, n;
+
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        lockstat_reset();
+        return 0;
+    }
+
+    // Times are in TSC cycles.
+    n = lockstat_hottest(locks, LOCKSTAT_TOP);
+    cprintf("lock            acquires   contended  avg wait  avg hold  worst wait\n");
+    for (i = 0; i < n; i++) {
+        lk = locks[i];
+        acq = lk->ls_acquires ? lk->ls_acquires : 1;
+#ifdef DEBUG_SPINLOCK
+        cprintf("%-14s", lk->name);
+#else
+        cprintf("%08x      ", lk);
+#endif
+        cprintf("  %10llu  %10llu  %8llu  %8llu  %llu",
+            lk->ls_acquires, lk->ls_contended,
+            lk->ls_contended ? lk->ls_wait / lk->ls_contended : 0,
+            lk->ls_hold / acq, lk->ls_max_wait);
+        if (lk->ls_max_wait_pc && debuginfo_eip(lk->ls_max_wait_pc, &info) >= 0)
+            cprintf(" at %s:%d: %.*s+%x", info.eip_file, info.eip_line,
+                info.eip_fn_namelen, info.eip_fn_name,
+                lk->ls_max_wait_pc - info.eip_fn_addr);
+        cprintf("\n");
+    }
+#else
+    cprintf("lockstat: kernel built without LOCKSTAT\n");
+#endif
+    return 0;
+}
+
+int
+mon_quantum(int argc, char **argv, struct Trapframe *tf)
+{
+    if (argc > 1 && sched_set_quantum(strtol(argv[1], NULL, 0)) < 0) {
+        cprintf("quantum: out of range\n");
+        return 0;
+    }
+    cprintf("quantum: %u us (LAPIC timer %u kHz, TSC %u kHz)\n",
+        sched_quantum_us, lapic_khz, tsc_khz);
+    return 0;
+}
+
 int
 mon_si(int argc, char** argv, struct Trapframe *tf)
 {
@@ -86,12 +176,22 @@ mon_si(int argc, char** argv, struct Trapframe *tf)
     }
 }
 
+// finds the entry holding va's permissions: the PTE, or the PDE itself
+// for a 4MB superpage (which then covers the whole 4MB)
+static pte_t *
+perm_entry(pde_t *pgdir, const void *va)
+{
+    pde_t *pde = (pde_t *) (pgdir+PDX(va));
+    if(*pde & PTE_PS)
+        return (pte_t *) pde;
+    return (pte_t *) KADDR((physaddr_t)((pte_t *)PTE_ADDR(*pde)+PTX(va)));
+}
+
 // sets specified permission bits
 void
 set_perm(pde_t *pgdir, const void *va, int perm)
 {
-    pde_t *pde = (pde_t *) (pgdir+PDX(va));
-    pte_t *pte = (pte_t *) KADDR((physaddr_t)((pte_t *)PTE_ADDR(*pde)+PTX(va)));
+    pte_t *pte = perm_entry(pgdir, va);
     *pte |= perm;
 }
 
@@ -99,19 +199,17 @@ set_perm(pde_t *pgdir, const void *va, int perm)
 void
 clear_perm(pde_t *pgdir, const void *va, int perm)
 {
-    pde_t *pde = (pde_t *) (pgdir+PDX(va));
-    pte_t *pte = (pte_t *) KADDR((physaddr_t)((pte_t *)PTE_ADDR(*pde)+PTX(va)));
-    *pte &= ~perm;
+    pte_t *pte = perm_entry(pgdir, va);
+    *pte &= ~(perm & ~PTE_PS);
 }
 
 // resets specified permission bits
 void
 reset_perm(pde_t *pgdir, const void *va, int perm)
 {
-    pde_t *pde = (pde_t *) (pgdir+PDX(va));
-    pte_t *pte = (pte_t *) KADDR((physaddr_t)((pte_t *)PTE_ADDR(*pde)+PTX(va)));
-    *pte &= ~0xFFF;
-    *pte |= perm;
+    pte_t *pte = perm_entry(pgdir, va);
+    *pte &= ~0xFFF | PTE_PS;
+    *pte |= perm & ~PTE_PS;
 }
 
 int
@@ -139,6 +237,7 @@ mon_resetperms(int argc, char **argv, struct Trapframe *tf){
                 }
             }
         }
+        tlb_flush_global();
     }
 
     return 0;
@@ -170,6 +269,7 @@ mon_setperms(int argc, char **argv, struct Trapframe *tf){
                 }
             }
         }
+        tlb_flush_global();
     }
 
     return 0;
@@ -201,6 +301,7 @@ mon_clearperms(int argc, char **argv, struct Trapframe *tf){
                 }
             }
         }
+        tlb_flush_global();
     }
 
     return 0;
@@ -270,8 +371,7 @@ mon_dumppmemory(int argc, char **argv, struct Trapframe *tf){
 pte_t
 get_perm(pde_t *pgdir, const void *va)
 {
-    pde_t *pde = (pde_t *) (pgdir+PDX(va));
-    pte_t *pte = (pte_t *) KADDR((physaddr_t)((pte_t *)PTE_ADDR(*pde)+PTX(va)));
+    pte_t *pte = perm_entry(pgdir, va);
     return *pte & 0xFFF;
 }
 
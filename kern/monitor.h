@@ -23,4 +23,8 @@ int mon_dumppmemory(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_si(int argc, char **argv, struct Trapframe *tf);
 int mon_pc(int argc, char **argv, struct Trapframe *tf);
+int mon_zeropool(int argc, char **argv, struct Trapframe *tf);
+int mon_memstat(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_quantum(int argc, char **argv, struct Trapframe *tf);
 #endif  // !JOS_KERN_MONITOR_H
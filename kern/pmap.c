@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;                  // Amount of physical memory (in pages)
@@ -18,7 +19,55 @@ static size_t npages_basemem;   // Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;                  // Kernel's initial page directory
 struct Page *pages;                 // Physical page state array
-static struct Page *page_free_list; // Free list of physical pages
+struct PmapStat *pmstat;            // Global statistics, mapped at UPMSTAT
+// Buddy allocator free lists: page_free_area[k] holds free blocks of
+// 2^k physically contiguous, 2^k-aligned pages.
+static struct Page *page_free_area[MAX_ORDER + 1];
+static size_t page_free_count;      // Pages on page_free_area
+
+// page_lock protects page_free_area.  Each CPU's page cache is only
+// touched by that CPU, with interrupts off, so it needs no lock.
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "page_lock"
+#endif
+};
+static bool page_cache_ready;       // Set once kern_pgdir is installed
+
+// Pages that idle CPUs have already zeroed, for page_alloc(ALLOC_ZERO).
+// Also protected by page_lock.
+static struct Page *page_zero_pool;
+static struct PageZeroStats page_zero_stats;
+
+// tlb_lock serializes TLB shootdowns; it protects the tlb_req_* request
+// that the targeted CPUs read when they see cpu_tlb_pending.
+static struct spinlock tlb_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "tlb_lock"
+#endif
+};
+static uintptr_t tlb_req_start, tlb_req_end;
+
+// Free reverse-map entries.  Seeded from boot_alloc so the boot-time
+// checks can map pages with the allocator drained, then grown a page
+// at a time.
+static struct Rmap *rmap_free_list;
+
+// rmap_lock protects rmap_free_list, every page's pp_ref and pp_rmap,
+// and the env_nresident/env_nshared counters, all of which can be
+// reached through a page shared between address spaces.  The page
+// tables themselves are protected by the owning env's env_vm_lock,
+// which callers of page_insert and page_remove hold.  Lock order is
+// env_vm_lock, then rmap_lock, then page_lock.
+static struct spinlock rmap_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "rmap_lock"
+#endif
+};
+
+// Above this many pages a shootdown flushes the whole TLB instead of
+// issuing one invlpg per page.
+#define TLB_FLUSH_MAX_PAGES 32
 
 
 // --------------------------------------------------------------
@@ -59,6 +108,8 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void page_init_high(void);
+static void rmap_add_entries(struct Rmap *rm, size_t size);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
@@ -66,6 +117,7 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void check_buddy(void);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -78,7 +130,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the buddy free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -160,6 +212,16 @@ mem_init(void)
         pages = (struct Page *) boot_alloc(pages_size);
     memset(pages, 0, pages_size);
 
+    //////////////////////////////////////////////////////////////////////
+    // Allocate the page of global statistics exported at UPMSTAT.
+    pmstat = (struct PmapStat *) boot_alloc(PGSIZE);
+    memset(pmstat, 0, PGSIZE);
+
+    //////////////////////////////////////////////////////////////////////
+    // Seed the reverse-map entry pool.
+    rmap_free_list = NULL;
+    rmap_add_entries((struct Rmap *) boot_alloc(PGSIZE), PGSIZE);
+
     //////////////////////////////////////////////////////////////////////
     // Make 'envs' point to an array of size 'NENV' of 'struct Env'.
     // LAB 3: Your code here.
@@ -191,7 +253,10 @@ mem_init(void)
     //      (ie. perm = PTE_U | PTE_P)
     //    - pages itself -- kernel RW, user NONE
     // Your code goes here:
-    boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_P | PTE_U);
+    // The last page of the window holds the statistics page instead.
+    assert(pages_size <= UPMSTAT - UPAGES);
+    boot_map_region(kern_pgdir, UPAGES, ROUNDUP(pages_size, PGSIZE), PADDR(pages), PTE_P | PTE_U);
+    boot_map_region(kern_pgdir, UPMSTAT, PGSIZE, PADDR(pmstat), PTE_P | PTE_U);
 
     //////////////////////////////////////////////////////////////////////
     // Map the 'envs' array read-only by the user at linear address UENVS
@@ -238,7 +303,10 @@ mem_init(void)
     //
     // If the machine reboots at this point, you've probably set up your
     // kern_pgdir wrong.
-    lcr3(PADDR(kern_pgdir));
+    pmap_load(kern_pgdir);
+
+    // Everything is mapped now; hand the rest of memory to the allocator.
+    page_init_high();
 
     check_page_free_list(0);
 
@@ -249,8 +317,15 @@ mem_init(void)
     cr0 &= ~(CR0_TS|CR0_EM);
     lcr0(cr0);
 
+    // Kernel mappings are PTE_G, so they survive the lcr3 in env_run.
+    lcr4(rcr4() | CR4_PGE);
+
+    // From here on page_alloc and page_free go through the per-CPU caches.
+    page_cache_ready = 1;
+
     // Some more checks, only possible after kern_pgdir is installed.
     check_page_installed_pgdir();
+    check_buddy();
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -289,38 +364,143 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct Page' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a binary
+// buddy allocator: a free block of 2^k pages starts at a page whose
+// index is a multiple of 2^k, and is merged with its equally sized
+// neighbour (its "buddy") whenever both are free.
 // --------------------------------------------------------------
 
 void
 internal_check_free_page_list(unsigned int caller)
 {
-    struct Page *cur, *prev = NULL;
-    for (cur = page_free_list; cur != NULL; cur = cur->pp_link) {
-        if (cur < &pages[0] || cur >= &pages[npages])
-            panic("%u: invalid page in free page list: index: x%x, pointed to by page x%x", caller, (cur - &pages[0]), (prev == NULL) ? 0xFFFFFFFF : (prev - &pages[0]));
-        if (page2pa(cur) > 0x10000000)
-            panic("%u: invalid page PA: %08x", caller, page2pa(cur));
-        prev = cur;
-     }
+    struct Page *cur, *prev;
+    int order;
+
+    for (order = 0; order <= MAX_ORDER; order++) {
+        prev = NULL;
+        for (cur = page_free_area[order]; cur != NULL; cur = cur->pp_link) {
+            if (cur < &pages[0] || cur >= &pages[npages])
+                panic("%u: invalid page in free page list: index: x%x, pointed to by page x%x", caller, (cur - &pages[0]), (prev == NULL) ? 0xFFFFFFFF : (prev - &pages[0]));
+            if (page2pa(cur) > 0x10000000)
+                panic("%u: invalid page PA: %08x", caller, page2pa(cur));
+            if (!cur->pp_free || cur->pp_order != order || cur->pp_prev != prev)
+                panic("%u: corrupt buddy block at index x%x", caller, (cur - &pages[0]));
+            prev = cur;
+        }
+    }
 }
 
 unsigned int
 internal_free_page_list_len() {
-    unsigned int i = 0;
-    struct Page *cur = page_free_list;
-    while( cur != NULL ) {
-        i++;
-        cur = cur->pp_link;
+    return page_free_count;
+}
+
+//
+// Atomically add n to a statistics counter.  The per-CPU page caches
+// update the counters without holding page_lock.
+//
+static inline void
+pmstat_add(volatile uint32_t *ctr, int n)
+{
+    asm volatile("lock; addl %1,%0" : "+m" (*ctr) : "ir" (n) : "cc");
+}
+
+//
+// The Env whose page directory is pgdir, or NULL for kern_pgdir.
+//
+static struct Env *
+pgdir_env(pde_t *pgdir)
+{
+    return pa2page(PADDR(pgdir))->pp_env;
+}
+
+static void
+buddy_push(struct Page *pp, int order)
+{
+    pp->pp_prev = NULL;
+    pp->pp_link = page_free_area[order];
+    if (pp->pp_link)
+        pp->pp_link->pp_prev = pp;
+    page_free_area[order] = pp;
+    pp->pp_order = order;
+    pp->pp_free = 1;
+    page_free_count += 1 << order;
+}
+
+static void
+buddy_unlink(struct Page *pp)
+{
+    if (pp->pp_prev)
+        pp->pp_prev->pp_link = pp->pp_link;
+    else
+        page_free_area[pp->pp_order] = pp->pp_link;
+    if (pp->pp_link)
+        pp->pp_link->pp_prev = pp->pp_prev;
+    pp->pp_link = pp->pp_prev = NULL;
+    pp->pp_free = 0;
+    page_free_count -= 1 << pp->pp_order;
+}
+
+//
+// Take a block of 2^order pages off the free lists, splitting the
+// smallest larger block if no block of the right size is free.
+// The caller must hold page_lock (or be running before the APs boot).
+//
+static struct Page *
+buddy_alloc(int order)
+{
+    struct Page *pp;
+    int k;
+
+    for (k = order; k <= MAX_ORDER && !page_free_area[k]; k++)
+        ;
+    if (k > MAX_ORDER)
+        return NULL;
+
+    pp = page_free_area[k];
+    buddy_unlink(pp);
+
+    // Hand the upper halves back as we split down to 'order'.
+    while (k > order) {
+        k--;
+        buddy_push(pp + (1 << k), k);
+    }
+    return pp;
+}
+
+//
+// Return a block of 2^order pages to the free lists, merging it with
+// its buddy for as long as the buddy is also free.
+// The caller must hold page_lock (or be running before the APs boot).
+//
+static void
+buddy_free(struct Page *pp, int order)
+{
+    size_t idx = pp - pages;
+    size_t buddy;
+
+    while (order < MAX_ORDER) {
+        buddy = idx ^ (1 << order);
+        if (buddy >= npages || !pages[buddy].pp_free
+            || pages[buddy].pp_order != order)
+            break;
+        buddy_unlink(&pages[buddy]);
+        idx &= ~(1 << order);
+        order++;
     }
-    return i;
+    buddy_push(&pages[idx], order);
 }
 
+// entry_pgdir only maps the first 4MB of physical memory, so page_init
+// frees just the pages below this; page_init_high frees the rest once
+// kern_pgdir is loaded.
+#define PAGE_INIT_LIMIT (PTSIZE / PGSIZE)
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy free lists.
 //
 void
 page_init(void)
@@ -357,8 +537,7 @@ page_init(void)
         }
         else {
             pages[i].pp_ref = 0;
-                    pages[i].pp_link = page_free_list;
-                    page_free_list = &pages[i];
+            buddy_free(&pages[i], 0);
         }
     }
 
@@ -372,11 +551,93 @@ page_init(void)
 
     for(i = PADDR(boot_alloc(0))/PGSIZE; i < npages; i++){
         pages[i].pp_ref = 0;
-        pages[i].pp_link = page_free_list;
-        page_free_list = &pages[i];
+        if(i < PAGE_INIT_LIMIT)
+            buddy_free(&pages[i], 0);
+    }
+
+    pmstat->ps_npages = npages;
+    pmstat->ps_free = page_free_count;
+    pmstat->ps_used = npages - page_free_count;
+}
+
+//
+// Free the pages that page_init held back because entry_pgdir does
+// not map them.  Called once kern_pgdir is loaded.
+//
+static void
+page_init_high(void)
+{
+    size_t i;
+
+    i = PADDR(boot_alloc(0))/PGSIZE;
+    if(i < PAGE_INIT_LIMIT)
+        i = PAGE_INIT_LIMIT;
+    for(; i < npages; i++)
+        buddy_free(&pages[i], 0);
+
+    pmstat->ps_free = page_free_count;
+    pmstat->ps_used = npages - page_free_count;
+}
+
+//
+// Move up to PGCACHE_BATCH pages from the buddy allocator into c's cache.
+//
+static void
+page_cache_refill(struct Cpu *c)
+{
+    struct Page *pp;
+
+    spin_lock(&page_lock);
+    while (c->cpu_pgcache_len < PGCACHE_BATCH && (pp = buddy_alloc(0))) {
+        pp->pp_link = c->cpu_pgcache;
+        c->cpu_pgcache = pp;
+        c->cpu_pgcache_len++;
+    }
+    spin_unlock(&page_lock);
+}
+
+//
+// Give 'n' pages from c's cache back to the buddy allocator.
+//
+static void
+page_cache_drain(struct Cpu *c, unsigned n)
+{
+    struct Page *pp;
+
+    spin_lock(&page_lock);
+    while (n-- > 0 && (pp = c->cpu_pgcache)) {
+        c->cpu_pgcache = pp->pp_link;
+        c->cpu_pgcache_len--;
+        buddy_free(pp, 0);
     }
+    spin_unlock(&page_lock);
 }
 
+//
+// Take a page from the pre-zeroed pool, or return NULL if it is empty.
+// 'zero' says whether the caller wanted it zeroed, for the statistics.
+//
+static struct Page *
+page_zero_pool_get(bool zero)
+{
+    struct Page *page;
+
+    spin_lock(&page_lock);
+    if((page = page_zero_pool) != NULL){
+        page_zero_pool = page->pp_link;
+        page_zero_stats.pzs_len--;
+        if(zero)
+            page_zero_stats.pzs_hits++;
+    } else if(zero)
+        page_zero_stats.pzs_misses++;
+    spin_unlock(&page_lock);
+    if(page){
+        page->pp_link = NULL;
+        pmstat_add(&pmstat->ps_zeroed, -1);
+        pmstat_add(&pmstat->ps_used, 1);
+    }
+    return page;
+}
 
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
@@ -384,21 +645,46 @@ page_init(void)
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
+// ALLOC_ZERO requests are served from the pre-zeroed pool when it has a
+// page; otherwise the page is zeroed here.
+//
+// Pages come from this CPU's page cache, which is refilled in batches
+// from the buddy allocator so that most allocations never take page_lock.
+// The cache is bypassed until kern_pgdir is installed, so the early
+// checks see the buddy allocator directly.  When the buddy allocator
+// runs dry, the pre-zeroed pool is the last resort.  Other CPUs' caches
+// are left alone: their owners use them without page_lock.
+//
 // Returns NULL if out of free memory.
 //
 // Hint: use page2kva and memset
 struct Page *
 page_alloc(int alloc_flags)
 {
-    if(page_free_list == NULL){
+    struct Cpu *c = thiscpu;
+    struct Page *page;
+
+    if(page_cache_ready && (alloc_flags & ALLOC_ZERO)
+       && (page = page_zero_pool_get(1)) != NULL)
+        return page;
+
+    if(page_cache_ready){
+        if(c->cpu_pgcache == NULL)
+            page_cache_refill(c);
+        if((page = c->cpu_pgcache) == NULL)
+            return page_zero_pool_get(0);
+        c->cpu_pgcache = page->pp_link;
+        c->cpu_pgcache_len--;
+    } else if((page = buddy_alloc(0)) == NULL){
         return NULL;
     }
+    pmstat_add(&pmstat->ps_free, -1);
+    pmstat_add(&pmstat->ps_used, 1);
 
-    struct Page * page = page_free_list;
+    page->pp_link = NULL;
     if(alloc_flags & ALLOC_ZERO){
-        memset(page2kva(page_free_list), 0, PGSIZE);
+        memset(page2kva(page), 0, PGSIZE);
     }
-    page_free_list = page_free_list->pp_link;
 
     return page;
 }
@@ -407,21 +693,148 @@ page_alloc(int alloc_flags)
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
 //
+// The page goes to this CPU's page cache; once the cache holds more than
+// PGCACHE_SIZE pages, a batch is handed back to the buddy allocator.
+//
 void
 page_free(struct Page *pp)
 {
+    struct Cpu *c = thiscpu;
+
     // Check if valid.
     if(pp->pp_ref > 1){
         return;
     }
-    // Add to page free list.
-    pp->pp_link = page_free_list;
     // Mark as free.
     pp->pp_ref = 0;
-    page_free_list = pp;
+    pmstat_add(&pmstat->ps_used, -1);
+    pmstat_add(&pmstat->ps_free, 1);
+
+    if(!page_cache_ready){
+        buddy_free(pp, 0);
+        return;
+    }
+
+    // Add to this CPU's page cache.
+    pp->pp_link = c->cpu_pgcache;
+    c->cpu_pgcache = pp;
+    if(++c->cpu_pgcache_len > PGCACHE_SIZE)
+        page_cache_drain(c, PGCACHE_BATCH);
+}
+//
+// Top up the pre-zeroed page pool by at most PAGE_ZERO_FILL_BATCH pages.
+// Meant for CPUs with nothing better to do; the caller need not hold the
+// kernel lock, and the zeroing itself is done without page_lock held.
+//
+void
+page_zero_pool_fill(void)
+{
+    struct Page *pp;
+    int n;
+
+    if(!page_cache_ready)
+        return;
+
+    for(n = 0; n < PAGE_ZERO_FILL_BATCH; n++){
+        if(page_zero_stats.pzs_len >= PAGE_ZERO_POOL_SIZE)
+            break;
+
+        spin_lock(&page_lock);
+        pp = buddy_alloc(0);
+        spin_unlock(&page_lock);
+        if(!pp)
+            break;
+
+        memset(page2kva(pp), 0, PGSIZE);
+
+        spin_lock(&page_lock);
+        pp->pp_link = page_zero_pool;
+        page_zero_pool = pp;
+        page_zero_stats.pzs_len++;
+        page_zero_stats.pzs_filled++;
+        spin_unlock(&page_lock);
+        pmstat_add(&pmstat->ps_free, -1);
+        pmstat_add(&pmstat->ps_zeroed, 1);
+    }
+}
+
+//
+// Does the pre-zeroed page pool want more pages?
+//
+bool
+page_zero_pool_low(void)
+{
+    return page_cache_ready && page_zero_stats.pzs_len < PAGE_ZERO_POOL_SIZE;
+}
+
+//
+// Copy out the pre-zeroed page pool's counters.
+//
+void
+page_zero_pool_stats(struct PageZeroStats *st)
+{
+    spin_lock(&page_lock);
+    *st = page_zero_stats;
+    spin_unlock(&page_lock);
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// and returns the Page of the first one.  alloc_flags is as for
+// page_alloc; ALLOC_ZERO clears the whole block.  As with page_alloc,
+// the reference counts are left at zero.
+//
+// Returns NULL if order is out of range or no large enough block is free.
+//
+struct Page *
+page_alloc_order(int order, int alloc_flags)
+{
+    struct Page *pp;
 
-    return;
+    if(order < 0 || order > MAX_ORDER)
+        return NULL;
+    if(order == 0)
+        return page_alloc(alloc_flags);
+
+    spin_lock(&page_lock);
+    pp = buddy_alloc(order);
+    spin_unlock(&page_lock);
+    if(!pp)
+        return NULL;
+    pmstat_add(&pmstat->ps_free, -(1 << order));
+    pmstat_add(&pmstat->ps_used, 1 << order);
+
+    if(alloc_flags & ALLOC_ZERO){
+        memset(page2kva(pp), 0, PGSIZE << order);
+    }
+    return pp;
 }
+
+//
+// Return a block obtained from page_alloc_order(order, ...).
+// Every page in the block must have a zero reference count.
+//
+void
+page_free_order(struct Page *pp, int order)
+{
+    int i;
+
+    if(order == 0){
+        page_free(pp);
+        return;
+    }
+
+    assert((pp - pages) % (1 << order) == 0);
+    for(i = 0; i < (1 << order); i++)
+        assert(pp[i].pp_ref == 0);
+
+    spin_lock(&page_lock);
+    buddy_free(pp, order);
+    spin_unlock(&page_lock);
+    pmstat_add(&pmstat->ps_used, -(1 << order));
+    pmstat_add(&pmstat->ps_free, 1 << order);
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
@@ -429,7 +842,12 @@ page_free(struct Page *pp)
 void
 page_decref(struct Page* pp)
 {
-    if (--pp->pp_ref == 0)
+    bool last;
+
+    spin_lock(&rmap_lock);
+    last = --pp->pp_ref == 0;
+    spin_unlock(&rmap_lock);
+    if (last)
         page_free(pp);
 }
 
@@ -460,6 +878,9 @@ page_decref(struct Page* pp)
 //   __physical memory__ address for the start of the page which forms the second
 //   level of the page table.
 //
+// If va falls in a 4MB superpage (PTE_PS), there is no page table to
+// walk and the page directory entry itself is returned.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
@@ -477,6 +898,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
         }
 
         page->pp_ref++;
+        if(pgdir_env(pgdir))
+            pgdir_env(pgdir)->env_npgtables++;
 
         // Not sure if necessary
         *pde &= 0xfff;
@@ -484,7 +907,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 
         return (pte_t *) KADDR((physaddr_t)((pte_t *)(page2pa(page))+PTX(va)));
     }
-    
+
+    if((*pde) & PTE_PS)
+        return (pte_t *) pde;
+
     return (pte_t *) KADDR((physaddr_t)((pte_t *)PTE_ADDR(*pde)+PTX(va)));
 }
 //
@@ -496,18 +922,198 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// Mappings above UTOP are the same in every address space, so they are
+// marked PTE_G and stay in the TLB across CR3 reloads.  Anything that
+// later changes them must call tlb_flush_global.
+//
+// Wherever va and pa are both 4MB aligned and at least 4MB remain, the
+// range is mapped with a single PTE_PS page directory entry instead of
+// a page table, so large regions such as the KERNBASE direct map use
+// one TLB entry per 4MB and no page table pages.
+//
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
     pte_t *pte;
     pde_t *pde;
-    int k;
-    for(k = 0; k < size/PGSIZE; k++){
-        pde = (pde_t *) (pgdir + PDX(va));
-        pte = pgdir_walk(pgdir, (void *) va, 1);
-        *pte = 0 | perm | PTE_P | ((physaddr_t) (pa + PGSIZE * k));
-        va += PGSIZE;
+    size_t off;
+
+    if(va >= UTOP)
+        perm |= PTE_G;
+
+    for(off = 0; off < size; ){
+        pde = (pde_t *) (pgdir + PDX(va + off));
+        if((va + off) % PTSIZE == 0 && (pa + off) % PTSIZE == 0
+           && size - off >= PTSIZE && !(*pde & PTE_P)){
+            *pde = perm | PTE_P | PTE_PS | (pa + off);
+            off += PTSIZE;
+            continue;
+        }
+        pte = pgdir_walk(pgdir, (void *) (va + off), 1);
+        assert(pte && !(*pte & PTE_PS));
+        *pte = 0 | perm | PTE_P | ((physaddr_t) (pa + off));
+        off += PGSIZE;
+    }
+}
+
+//
+// Put the 'size' bytes at 'rm' on the reverse-map entry free list.
+//
+static void
+rmap_add_entries(struct Rmap *rm, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size / sizeof(struct Rmap); i++) {
+        rm[i].rm_next = rmap_free_list;
+        rmap_free_list = &rm[i];
+    }
+}
+
+static struct Rmap *
+rmap_alloc(void)
+{
+    struct Page *pp;
+    struct Rmap *rm;
+
+    if (!rmap_free_list) {
+        if (!(pp = page_alloc(0)))
+            return NULL;
+        // Pool pages are never freed; keep them off the free lists.
+        pp->pp_ref = 1;
+        rmap_add_entries((struct Rmap *) page2kva(pp), PGSIZE);
+    }
+    rm = rmap_free_list;
+    rmap_free_list = rm->rm_next;
+    return rm;
+}
+
+//
+// Charge (delta 1) or uncharge (delta -1) the mapping rm, which is on
+// pp's reverse map, to its env.  A page mapped in more than one place
+// counts as shared in every env that maps it, so the first and last
+// extra mappings also update the other mappers.
+//
+static void
+rmap_account(struct Page *pp, struct Rmap *rm, int delta)
+{
+    struct Env *e = pgdir_env(rm->rm_pgdir);
+    struct Rmap *other;
+
+    if (e)
+        e->env_nresident += delta;
+
+    if (!pp->pp_rmap->rm_next)
+        return;
+    if (!pp->pp_rmap->rm_next->rm_next) {
+        // Exactly two mappings: the page starts or stops being shared.
+        for (other = pp->pp_rmap; other; other = other->rm_next)
+            if ((e = pgdir_env(other->rm_pgdir)))
+                e->env_nshared += delta;
+    } else if (e)
+        e->env_nshared += delta;
+}
+
+//
+// Remove (pgdir, va) from pp's reverse map.
+//
+static void
+rmap_remove(struct Page *pp, pde_t *pgdir, uintptr_t va)
+{
+    struct Rmap **prm, *rm;
+
+    for (prm = &pp->pp_rmap; (rm = *prm); prm = &rm->rm_next)
+        if (rm->rm_pgdir == pgdir && rm->rm_va == va) {
+            rmap_account(pp, rm, -1);
+            *prm = rm->rm_next;
+            rm->rm_next = rmap_free_list;
+            rmap_free_list = rm;
+            return;
+        }
+    panic("rmap_remove: page %08x not mapped at %08x", page2pa(pp), va);
+}
+
+//
+// Clear *pte, which maps va in pgdir, and drop its page.  If that was
+// the page's last reference, it is freed, or put on *dead if dead is
+// not NULL: inside a tlb_batch, a page can't be reused until the
+// batch's shootdown has run.
+//
+static void
+pte_remove(pde_t *pgdir, pte_t *pte, uintptr_t va, struct Page **dead)
+{
+    struct Page *pp = pa2page(PTE_ADDR(*pte));
+    bool last;
+
+    // Clear the PTE before shooting down the TLBs, so no CPU can
+    // reload the old translation in between.
+    *pte = 0;
+    tlb_invalidate(pgdir, (void *) va);
+
+    spin_lock(&rmap_lock);
+    rmap_remove(pp, pgdir, va);
+    last = --pp->pp_ref == 0;
+    spin_unlock(&rmap_lock);
+    if (!last)
+        return;
+    if (dead) {
+        pp->pp_link = *dead;
+        *dead = pp;
+    } else
+        page_free(pp);
+}
+
+//
+// Point *pte, the entry for va in pgdir, at pp with permission perm,
+// replacing whatever it mapped (see pte_remove for 'dead').  Remapping
+// the page already there only changes the permissions.
+//
+static int
+pte_insert(pde_t *pgdir, pte_t *pte, struct Page *pp, uintptr_t va, int perm,
+           struct Page **dead)
+{
+    struct Rmap *rm;
+
+    if ((*pte & PTE_P) && PTE_ADDR(*pte) == page2pa(pp)) {
+        *pte = page2pa(pp) | PTE_P | perm;
+        tlb_invalidate(pgdir, (void *) va);
+        return 0;
+    }
+
+    spin_lock(&rmap_lock);
+    if ((rm = rmap_alloc()) == NULL) {
+        spin_unlock(&rmap_lock);
+        return -E_NO_MEM;
+    }
+    pp->pp_ref++;
+    spin_unlock(&rmap_lock);
+
+    if (*pte & PTE_P)
+        pte_remove(pgdir, pte, va, dead);
+    *pte = page2pa(pp) | PTE_P | perm;
+
+    spin_lock(&rmap_lock);
+    rm->rm_pgdir = pgdir;
+    rm->rm_va = va;
+    rm->rm_next = pp->pp_rmap;
+    pp->pp_rmap = rm;
+    rmap_account(pp, rm, 1);
+    spin_unlock(&rmap_lock);
+    return 0;
+}
+
+//
+// Free the pages pte_remove put on a dead list.
+//
+static void
+page_free_dead(struct Page *dead)
+{
+    struct Page *next;
+
+    for (; dead; dead = next) {
+        next = dead->pp_link;
+        page_free(dead);
     }
 }
 
@@ -529,9 +1135,11 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// The new mapping is also recorded in pp's reverse map.
+//
 // RETURNS:
 //   0 on success
-//   -E_NO_MEM, if page table couldn't be allocated
+//   -E_NO_MEM, if page table or reverse-map entry couldn't be allocated
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -547,13 +1155,9 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
     }
 
     *pde |= PTE_P | perm;
-    pp->pp_ref++;
-
-    page_remove(pgdir, va);
 
-    *pte = 0 | PTE_P | perm | page2pa(pp);
-
-    return 0;
+    return pte_insert(pgdir, pte, pp, ROUNDDOWN((uintptr_t) va, PGSIZE),
+                      perm, NULL);
 }
 
 //
@@ -615,34 +1219,342 @@ page_remove(pde_t *pgdir, void *va)
         return;
     }
 
-    page_decref(page);
+    pte_remove(pgdir, pte, ROUNDDOWN((uintptr_t) va, PGSIZE), NULL);
+}
+
+//
+// The page range functions below work on [va, va + len) of one address
+// space, where va and len are page-aligned.  Each walks every page
+// table the range touches once and sends a single TLB shootdown at the
+// end, freeing the pages they unmapped only after it.  Pages beyond
+// the first error are left alone; those before it stay changed.
+// They must not be called inside a tlb_batch.
+//
 
-    pte_t *pte2;
-    pde_t *pde;
-    pde = (pde_t *) (pgdir+PDX(va));
+//
+// Map a fresh zeroed page with permission perm at every page of the
+// range in pgdir.
+//
+int
+page_alloc_range(pde_t *pgdir, uintptr_t va, size_t len, int perm)
+{
+    uintptr_t end = va + len;
+    struct Page *dead = NULL, *pp;
+    pte_t *pt = NULL;
+    int r = 0;
+
+    assert(!thiscpu->cpu_tlb_batch);
+    tlb_batch_begin(pgdir);
+    for (; va < end; va += PGSIZE) {
+        if ((!pt || PTX(va) == 0) &&
+            !(pt = pgdir_walk(pgdir, (void *) ROUNDDOWN(va, PTSIZE), 1))) {
+            r = -E_NO_MEM;
+            break;
+        }
+        if (!(pp = page_alloc(ALLOC_ZERO))) {
+            r = -E_NO_MEM;
+            break;
+        }
+        if ((r = pte_insert(pgdir, &pt[PTX(va)], pp, va, perm, &dead)) < 0) {
+            page_free(pp);
+            break;
+        }
+    }
+    tlb_batch_end();
+    page_free_dead(dead);
+    return r;
+}
 
-    if(*pde & PTE_P){
-        pte = (pte_t *) KADDR(PTE_ADDR(*pde));
-        pte2 = (pte_t *) (pte+PTX(va));
+//
+// Map each page of the range in src at the same address in dst, with
+// its permissions in src less the bits in 'clear', plus those in 'set'.
+// Holes in src are skipped.
+//
+int
+page_map_range(pde_t *src, pde_t *dst, uintptr_t va, size_t len,
+               int set, int clear)
+{
+    uintptr_t end = va + len, next;
+    struct Page *dead = NULL;
+    pte_t *spt, *dpt;
+    int r = 0;
+
+    assert(!thiscpu->cpu_tlb_batch);
+    tlb_batch_begin(dst);
+    for (; va < end && r == 0; va = next) {
+        next = MIN(ROUNDDOWN(va, PTSIZE) + PTSIZE, end);
+        if (!(spt = pgdir_walk(src, (void *) ROUNDDOWN(va, PTSIZE), 0)))
+            continue;
+        for (dpt = NULL; va < next; va += PGSIZE) {
+            if (!(spt[PTX(va)] & PTE_P))
+                continue;
+            if (!dpt &&
+                !(dpt = pgdir_walk(dst, (void *) ROUNDDOWN(va, PTSIZE), 1))) {
+                r = -E_NO_MEM;
+                break;
+            }
+            r = pte_insert(dst, &dpt[PTX(va)], pa2page(PTE_ADDR(spt[PTX(va)])),
+                           va, (spt[PTX(va)] & PTE_SYSCALL & ~clear) | set,
+                           &dead);
+            if (r < 0)
+                break;
+        }
+    }
+    tlb_batch_end();
+    page_free_dead(dead);
+    return r;
+}
 
-        if(*pte2 & PTE_P){
-            tlb_invalidate(pgdir, va);
+//
+// Map each page of the range in src at the same address in dst, for
+// fork.  Pages writable in src are made copy-on-write in both, a page
+// table at a time; the rest are shared as they are.  dst must not have
+// run yet, so only src's TLBs need shooting down.
+//
+int
+page_cow_range(pde_t *src, pde_t *dst, uintptr_t va, size_t len)
+{
+    uintptr_t end = va + len, next;
+    pte_t *spt, *dpt, *pte;
+    int r = 0;
+
+    assert(!thiscpu->cpu_tlb_batch);
+    tlb_batch_begin(src);
+    for (; va < end && r == 0; va = next) {
+        next = MIN(ROUNDDOWN(va, PTSIZE) + PTSIZE, end);
+        if (!(spt = pgdir_walk(src, (void *) ROUNDDOWN(va, PTSIZE), 0)))
+            continue;
+        for (dpt = NULL; va < next; va += PGSIZE) {
+            pte = &spt[PTX(va)];
+            if (!(*pte & PTE_P))
+                continue;
+            if (!dpt &&
+                !(dpt = pgdir_walk(dst, (void *) ROUNDDOWN(va, PTSIZE), 1))) {
+                r = -E_NO_MEM;
+                break;
+            }
+            if (*pte & PTE_W) {
+                *pte = (*pte & ~PTE_W) | PTE_COW;
+                tlb_invalidate(src, (void *) va);
+            }
+            r = pte_insert(dst, &dpt[PTX(va)], pa2page(PTE_ADDR(*pte)), va,
+                           *pte & PTE_SYSCALL, NULL);
+            if (r < 0)
+                break;
         }
+    }
+    tlb_batch_end();
+    return r;
+}
+
+//
+// Unmap every page of the range in pgdir.
+//
+void
+page_remove_range(pde_t *pgdir, uintptr_t va, size_t len)
+{
+    uintptr_t end = va + len, next;
+    struct Page *dead = NULL;
+    pte_t *pt;
+
+    assert(!thiscpu->cpu_tlb_batch);
+    tlb_batch_begin(pgdir);
+    for (; va < end; va = next) {
+        next = MIN(ROUNDDOWN(va, PTSIZE) + PTSIZE, end);
+        if (!(pt = pgdir_walk(pgdir, (void *) ROUNDDOWN(va, PTSIZE), 0)))
+            continue;
+        for (; va < next; va += PGSIZE)
+            if (pt[PTX(va)] & PTE_P)
+                pte_remove(pgdir, &pt[PTX(va)], va, &dead);
+    }
+    tlb_batch_end();
+    page_free_dead(dead);
+}
+
+//
+// Unmap pp from every address space it is mapped in via page_insert.
+// Takes O(number of mappings); pp is freed if nothing else holds it.
+// The caller must hold the kernel lock, since the env_vm_locks of the
+// address spaces involved are not taken.
+//
+void
+page_unmap_all(struct Page *pp)
+{
+    struct Rmap *rm;
+
+    while ((rm = pp->pp_rmap) != NULL)
+        page_remove(rm->rm_pgdir, (void *) rm->rm_va);
+}
+
+//
+// Load pgdir into cr3 and note it in thiscpu->cpu_pgdir, so that TLB
+// shootdowns for pgdir know to interrupt this CPU.  All cr3 loads
+// after boot go through here.
+//
+void
+pmap_load(pde_t *pgdir)
+{
+    // lcr3 serializes, so the store is visible to other CPUs before
+    // this CPU can cache any translation from pgdir.
+    thiscpu->cpu_pgdir = pgdir;
+    lcr3(PADDR(pgdir));
+}
+
+//
+// Flush [start, end) from this CPU's TLB.
+//
+static void
+tlb_flush_range(uintptr_t start, uintptr_t end)
+{
+    uintptr_t va;
 
-        *pte2 = 0;
+    if (end - start > TLB_FLUSH_MAX_PAGES * PGSIZE) {
+        if (end > UTOP)
+            tlb_flush_global();
+        else
+            tlbflush();
+        return;
     }
+    for (va = start; va < end; va += PGSIZE)
+        invlpg((void *) va);
+}
+
+//
+// Does CPU c need to hear about changes to [start, end) in pgdir?
+// Kernel mappings are shared by every address space.
+//
+static bool
+tlb_is_target(struct Cpu *c, pde_t *pgdir, uintptr_t end)
+{
+    return c != thiscpu && c->cpu_status != CPU_UNUSED
+        && (end > UTOP || c->cpu_pgdir == pgdir);
+}
+
+//
+// Make every other CPU that has pgdir loaded drop [start, end) from
+// its TLB, and wait until they all have.  One IPI per target CPU,
+// however large the range.
+//
+static void
+tlb_shootdown(pde_t *pgdir, uintptr_t start, uintptr_t end)
+{
+    struct Cpu *c;
+    bool any = 0;
+
+    // Order our page table writes before the reads of cpu_pgdir.
+    asm volatile("mfence" ::: "memory");
+    for (c = cpus; c < cpus + ncpu; c++)
+        any |= tlb_is_target(c, pgdir, end);
+    if (!any)
+        return;
+
+    spin_lock(&tlb_lock);
+    tlb_req_start = start;
+    tlb_req_end = end;
+    for (c = cpus; c < cpus + ncpu; c++)
+        if (tlb_is_target(c, pgdir, end)) {
+            c->cpu_tlb_pending = 1;
+            lapic_ipi_dest(c->cpu_id, T_TLBFLUSH);
+        }
+
+    // Targets in user mode take the IPI right away; targets in the
+    // kernel (interrupts off) see cpu_tlb_pending when they next spin
+    // on a lock.  Nothing can be posted for us while we wait: every
+    // other shooter is spinning on tlb_lock, and answering what was
+    // posted for it in spin_lock's wait loop.
+    for (c = cpus; c < cpus + ncpu; c++)
+        while (c->cpu_tlb_pending)
+            asm volatile("pause");
+    spin_unlock(&tlb_lock);
+}
+
+//
+// Carry out a TLB shootdown posted for this CPU, if there is one.
+// Called from the T_TLBFLUSH handler and from spin_lock's wait loop.
+//
+void
+tlb_shootdown_poll(void)
+{
+    struct Cpu *c = thiscpu;
+
+    if (!c->cpu_tlb_pending)
+        return;
+    tlb_flush_range(tlb_req_start, tlb_req_end);
+    c->cpu_tlb_pending = 0;
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Other CPUs using the same page tables are shot down as well,
+// or, inside tlb_batch_begin/end, once for the whole batch.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+    struct Cpu *c = thiscpu;
+    uintptr_t start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+
     // Flush the entry only if we're modifying the current address space.
-    if (!curenv || curenv->env_pgdir == pgdir)
+    if (c->cpu_pgdir == pgdir || start >= UTOP)
         invlpg(va);
+
+    if (c->cpu_tlb_batch && c->cpu_tlb_batch_pgdir == pgdir) {
+        if (start < c->cpu_tlb_batch_start)
+            c->cpu_tlb_batch_start = start;
+        if (start + PGSIZE > c->cpu_tlb_batch_end)
+            c->cpu_tlb_batch_end = start + PGSIZE;
+        return;
+    }
+    tlb_shootdown(pgdir, start, start + PGSIZE);
+}
+
+//
+// Batch the remote TLB invalidations for pgdir until the matching
+// tlb_batch_end, then send them as a single shootdown covering every
+// page invalidated in between.  Use around loops that change many
+// PTEs of one address space.  The caller must not let another CPU
+// reuse a page it unmapped before tlb_batch_end.
+//
+void
+tlb_batch_begin(pde_t *pgdir)
+{
+    struct Cpu *c = thiscpu;
+
+    if (c->cpu_tlb_batch++ == 0) {
+        c->cpu_tlb_batch_pgdir = pgdir;
+        c->cpu_tlb_batch_start = ~0;
+        c->cpu_tlb_batch_end = 0;
+    }
+}
+
+void
+tlb_batch_end(void)
+{
+    struct Cpu *c = thiscpu;
+
+    assert(c->cpu_tlb_batch > 0);
+    if (--c->cpu_tlb_batch == 0 && c->cpu_tlb_batch_start < c->cpu_tlb_batch_end)
+        tlb_shootdown(c->cpu_tlb_batch_pgdir,
+                      c->cpu_tlb_batch_start, c->cpu_tlb_batch_end);
+}
+
+//
+// Flush the whole TLB, global (kernel) entries included.  Needed after
+// changing a mapping above UTOP other than through tlb_invalidate,
+// since reloading CR3 leaves PTE_G entries in place.
+//
+void
+tlb_flush_global(void)
+{
+    uint32_t cr4 = rcr4();
+
+    if (cr4 & CR4_PGE) {
+        // Toggling PGE flushes every TLB entry.
+        lcr4(cr4 & ~CR4_PGE);
+        lcr4(cr4);
+    } else
+        tlbflush();
 }
 
 //
@@ -689,17 +1601,89 @@ mmio_map_region(physaddr_t pa, size_t size)
 
 static uintptr_t user_mem_check_addr;
 
+//
+// Walk the user range [va, va+len) of 'env', checking every page that
+// contains any of it for 'perm | PTE_P'.  Each page table is looked up
+// once and its PTEs are then scanned in order, rather than doing a full
+// two-level walk for every 4K page.  Untouched demand-zero pages inside
+// a reserved region are faulted in as they are reached.
+//
+// If 'kbuf' is non-NULL the range is also copied, a page at a time
+// through the kernel's mapping of physical memory, into 'kbuf' or, if
+// 'to_user' is set, out of it.  This works whether or not 'env' is the
+// loaded address space.  A copy that faults part way through leaves the
+// bytes before the bad page already copied.
+//
+// On error, sets 'user_mem_check_addr' to the first bad address and
+// returns -E_FAULT.
+//
+static int
+user_mem_walk(struct Env *env, uintptr_t va, size_t len, int perm,
+              char *kbuf, bool to_user)
+{
+    uintptr_t a = va, end = va + len, wend, ptend, pgend;
+    bool over = end < va || end > ULIM;
+    pde_t *pde;
+    pte_t *pt, pte;
+    char *kva;
+    size_t n;
+
+    perm |= PTE_P;
+    wend = over ? MAX(va, ULIM) : end;
+
+    while (a < wend) {
+        pde = &env->env_pgdir[PDX(a)];
+        pt = (*pde & (PTE_P | PTE_PS)) == PTE_P ?
+            (pte_t *) KADDR(PTE_ADDR(*pde)) : NULL;
+        ptend = MIN(wend, ROUNDDOWN(a, PTSIZE) + PTSIZE);
+
+        for (; a < ptend; a = pgend) {
+            pgend = MIN(ROUNDDOWN(a, PGSIZE) + PGSIZE, wend);
+
+            if (*pde & PTE_PS)
+                pte = *pde + (PTX(a) << PTXSHIFT);
+            else
+                pte = pt ? pt[PTX(a)] : 0;
+
+            if (!(pte & PTE_P) && env_region_fault(env, a) == 0) {
+                pt = (pte_t *) KADDR(PTE_ADDR(*pde));
+                pte = pt[PTX(a)];
+            }
+
+            if ((*pde & perm) != perm || (pte & perm) != perm) {
+                user_mem_check_addr = a;
+                return -E_FAULT;
+            }
+
+            if (kbuf) {
+                n = pgend - a;
+                kva = (char *) KADDR(PTE_ADDR(pte)) + PGOFF(a);
+                if (to_user)
+                    memmove(kva, kbuf, n);
+                else
+                    memmove(kbuf, kva, n);
+                kbuf += n;
+            }
+        }
+    }
+
+    if (over) {
+        user_mem_check_addr = MAX(va, ULIM);
+        return -E_FAULT;
+    }
+    return 0;
+}
+
 //
 // Check that an environment is allowed to access the range of memory
 // [va, va+len) with permissions 'perm | PTE_P'.
 // Normally 'perm' will contain PTE_U at least, but this is not required.
-// 'va' and 'len' need not be page-aligned; you must test every page that
-// contains any of that range.  You will test either 'len/PGSIZE',
-// 'len/PGSIZE + 1', or 'len/PGSIZE + 2' pages.
+// 'va' and 'len' need not be page-aligned; every page that contains any
+// of that range is tested.
 //
 // A user program can access a virtual address if (1) the address is below
-// ULIM, and (2) the page table gives it permission.  These are exactly
-// the tests you should implement here.
+// ULIM, and (2) both the page directory and page table entries give it
+// permission.
 //
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
@@ -710,45 +1694,30 @@ static uintptr_t user_mem_check_addr;
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
-    // LAB 3: Your code here.
-uintptr_t start = (uintptr_t) ROUNDDOWN(va, PGSIZE);
-        uintptr_t end = (uintptr_t) ROUNDUP(va + len, PGSIZE);
-        perm |= PTE_P;
-
-        // Start allocating pages, by setting PTEs
-        for (; start < end; start += PGSIZE) {
-                pte_t *pte = pgdir_walk(env->env_pgdir, (void *) start, 0);
-                if (start >= ULIM || !pte || !(*pte && perm == perm)) { // invalid
-                        user_mem_check_addr = start < (uint32_t) va ? (uint32_t) va : start;
-                        return -E_FAULT;
-                }
-        }
-
-        return 0;
-
-/*    perm |= PTE_U | PTE_P;
-    
-    pte_t *pte;
-    uintptr_t current_va;
-
-    for(current_va = (uintptr_t) va; current_va <= ((uintptr_t) va + len - 1); current_va += PGSIZE){
-        if(current_va >= ULIM){
-            user_mem_check_addr = current_va;
-            return -E_FAULT;
-        }
-
-        pte = pgdir_walk(env->env_pgdir, (void *) current_va, 0);
-
-        if(pte == NULL || (*pte & perm) != perm){
-            user_mem_check_addr = current_va;
-            return -E_FAULT;
-        }
+    return user_mem_walk(env, (uintptr_t) va, len, perm, NULL, 0);
+}
 
-        current_va = ROUNDDOWN(current_va, PGSIZE);
-    }
+//
+// Copy 'len' bytes from user address 'usrc' in 'env' to the kernel
+// buffer 'dst', checking PTE_U on the way.
+// Returns 0 on success, -E_FAULT if any of the source range is bad.
+//
+int
+copyin(struct Env *env, void *dst, const void *usrc, size_t len)
+{
+    return user_mem_walk(env, (uintptr_t) usrc, len, PTE_U, dst, 0);
+}
 
-    return 0;
-*/
+//
+// Copy 'len' bytes from the kernel buffer 'src' to user address 'udst'
+// in 'env', checking PTE_U | PTE_W on the way.
+// Returns 0 on success, -E_FAULT if any of the destination range is bad.
+//
+int
+copyout(struct Env *env, void *udst, const void *src, size_t len)
+{
+    return user_mem_walk(env, (uintptr_t) udst, len, PTE_U | PTE_W,
+                         (char *) src, 1);
 }
 
 //
@@ -774,67 +1743,95 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the buddy free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-    struct Page *pp;
+    struct Page *blk, *pp;
     unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
     int nfree_basemem = 0, nfree_extmem = 0;
+    int order, i;
     char *first_free_page;
 
-    if (!page_free_list)
-        panic("'page_free_list' is a null pointer!");
-
-    if (only_low_memory) {
-        // Move pages with lower addresses first in the free
-        // list, since entry_pgdir does not map all pages.
-        struct Page *pp1, *pp2;
-        struct Page **tp[2] = { &pp1, &pp2 };
-        for (pp = page_free_list; pp; pp = pp->pp_link) {
-            int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-            *tp[pagetype] = pp;
-            tp[pagetype] = &pp->pp_link;
-        }
-        *tp[1] = 0;
-        *tp[0] = pp2;
-        page_free_list = pp1;
-    }
+    if (!internal_free_page_list_len())
+        panic("the buddy free lists are empty!");
+    internal_check_free_page_list(0);
 
     // if there's a page that shouldn't be on the free list,
     // try to make sure it eventually causes trouble.
-    for (pp = page_free_list; pp; pp = pp->pp_link)
-        if (PDX(page2pa(pp)) < pdx_limit)
-            memset(page2kva(pp), 0x97, 128);
+    for (order = 0; order <= MAX_ORDER; order++)
+        for (blk = page_free_area[order]; blk; blk = blk->pp_link)
+            for (i = 0, pp = blk; i < (1 << order); i++, pp++)
+                if (PDX(page2pa(pp)) < pdx_limit)
+                    memset(page2kva(pp), 0x97, 128);
 
     first_free_page = (char *) boot_alloc(0);
-    for (pp = page_free_list; pp; pp = pp->pp_link) {
-        // check that we didn't corrupt the free list itself
-        assert(pp >= pages);
-        assert(pp < pages + npages);
-        assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-        // check a few pages that shouldn't be on the free list
-        assert(page2pa(pp) != 0);
-        assert(page2pa(pp) != IOPHYSMEM);
-        assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-        assert(page2pa(pp) != EXTPHYSMEM);
-        assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-        // (new test for lab 4)
-        assert(page2pa(pp) != MPENTRY_PADDR);
-
-        if (page2pa(pp) < EXTPHYSMEM)
-            ++nfree_basemem;
-        else
-            ++nfree_extmem;
-    }
+    for (order = 0; order <= MAX_ORDER; order++)
+        for (blk = page_free_area[order]; blk; blk = blk->pp_link) {
+            // blocks are aligned to their size and lie inside pages[]
+            assert((blk - pages) % (1 << order) == 0);
+            assert(blk + (1 << order) <= pages + npages);
+
+            for (i = 0, pp = blk; i < (1 << order); i++, pp++) {
+                // check that we didn't corrupt the free list itself
+                assert(pp >= pages);
+                assert(pp < pages + npages);
+                assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+                assert(pp->pp_ref == 0);
+
+                // before kern_pgdir is loaded only mapped pages are free
+                assert(PDX(page2pa(pp)) < pdx_limit);
+
+                // check a few pages that shouldn't be on the free list
+                assert(page2pa(pp) != 0);
+                assert(page2pa(pp) != IOPHYSMEM);
+                assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+                assert(page2pa(pp) != EXTPHYSMEM);
+                assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+                // (new test for lab 4)
+                assert(page2pa(pp) != MPENTRY_PADDR);
+
+                if (page2pa(pp) < EXTPHYSMEM)
+                    ++nfree_basemem;
+                else
+                    ++nfree_extmem;
+            }
+        }
 
     assert(nfree_basemem > 0);
     assert(nfree_extmem > 0);
     cprintf("check_page_free_list(%u) passed!\n", only_low_memory);
 }
 
+//
+// Allocate every free page and return them chained through pp_link,
+// so a check can run with an empty allocator.  Only used before the
+// per-CPU page caches are enabled.
+//
+static struct Page *
+check_steal_free_pages(void)
+{
+    struct Page *pp, *fl = NULL;
+
+    while ((pp = page_alloc(0))) {
+        pp->pp_link = fl;
+        fl = pp;
+    }
+    return fl;
+}
+
+static void
+check_return_free_pages(struct Page *fl)
+{
+    struct Page *pp;
+
+    while ((pp = fl)) {
+        fl = pp->pp_link;
+        page_free(pp);
+    }
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -852,8 +1849,7 @@ check_page_alloc(void)
         panic("'pages' is a null pointer!");
 
     // check number of free pages
-    for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-        ++nfree;
+    nfree = internal_free_page_list_len();
 
     // should be able to allocate three pages
     pp0 = pp1 = pp2 = 0;
@@ -869,8 +1865,7 @@ check_page_alloc(void)
     assert(page2pa(pp2) < npages*PGSIZE);
 
     // temporarily steal the rest of the free pages
-    fl = page_free_list;
-    page_free_list = 0;
+    fl = check_steal_free_pages();
 
     // should be no free memory
     assert(!page_alloc(0));
@@ -898,7 +1893,7 @@ check_page_alloc(void)
         assert(c[i] == 0);
 
     // give free list back
-    page_free_list = fl;
+    check_return_free_pages(fl);
 
     // free the pages we took
     page_free(pp0);
@@ -906,9 +1901,7 @@ check_page_alloc(void)
     page_free(pp2);
 
     // number of free pages should be the same
-    for (pp = page_free_list; pp; pp = pp->pp_link)
-        --nfree;
-    assert(nfree == 0);
+    assert(nfree == internal_free_page_list_len());
 
     cprintf("check_page_alloc() succeeded!\n");
 }
@@ -934,6 +1927,9 @@ check_kern_pgdir(void)
     for (i = 0; i < n; i += PGSIZE)
         assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
+    // check statistics page
+    assert(check_va2pa(pgdir, UPMSTAT) == PADDR(pmstat));
+
     // check envs array (new test for lab 3)
     n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
     for (i = 0; i < n; i += PGSIZE)
@@ -989,6 +1985,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
     pgdir = &pgdir[PDX(va)];
     if (!(*pgdir & PTE_P))
         return ~0;
+    if (*pgdir & PTE_PS)
+        return PTE_ADDR(*pgdir) + (va & (PTSIZE - 1) & ~(PGSIZE - 1));
     p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
     if (!(p[PTX(va)] & PTE_P))
         return ~0;
@@ -1019,8 +2017,7 @@ check_page(void)
     assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
     // temporarily steal the rest of the free pages
-    fl = page_free_list;
-    page_free_list = 0;
+    fl = check_steal_free_pages();
 
     // should be no free memory
     assert(!page_alloc(0));
@@ -1135,7 +2132,7 @@ check_page(void)
     pp0->pp_ref = 0;
 
     // give free list back
-    page_free_list = fl;
+    check_return_free_pages(fl);
 
     // free the pages we took
     page_free(pp0);
@@ -1210,3 +2207,42 @@ check_page_installed_pgdir(void)
     cprintf("check_page_installed_pgdir() succeeded!\n");
 }
 
+//
+// Check the buddy allocator's multi-page interface.
+//
+static void
+check_buddy(void)
+{
+    struct Page *pp0, *pp1;
+    unsigned nfree;
+    char *c;
+    int i;
+
+    nfree = internal_free_page_list_len();
+
+    // blocks are aligned, zeroed on request, and disjoint
+    assert((pp0 = page_alloc_order(3, 0)));
+    memset(page2kva(pp0), 0x5a, 8 * PGSIZE);
+    page_free_order(pp0, 3);
+    assert((pp0 = page_alloc_order(3, ALLOC_ZERO)));
+    assert((pp0 - pages) % 8 == 0);
+    c = page2kva(pp0);
+    for (i = 0; i < 8 * PGSIZE; i++)
+        assert(c[i] == 0);
+    assert((pp1 = page_alloc_order(2, 0)));
+    assert((pp1 - pages) % 4 == 0);
+    assert(pp1 + 4 <= pp0 || pp1 >= pp0 + 8);
+    assert(internal_free_page_list_len() == nfree - 12);
+
+    // out-of-range orders fail
+    assert(!page_alloc_order(MAX_ORDER + 1, 0));
+    assert(!page_alloc_order(-1, 0));
+
+    // freeing coalesces back to where we started
+    page_free_order(pp1, 2);
+    page_free_order(pp0, 3);
+    assert(internal_free_page_list_len() == nfree);
+    internal_check_free_page_list(0);
+
+    cprintf("check_buddy() succeeded!\n");
+}
@@ -13,6 +13,7 @@ struct Env;
 extern char bootstacktop[], bootstack[];
 
 extern struct Page *pages;
+extern struct PmapStat *pmstat;
 extern size_t npages;
 
 extern pde_t *kern_pgdir;
@@ -51,20 +52,61 @@ enum {
     ALLOC_ZERO = 1<<0,
 };
 
+// Largest block the buddy allocator hands out: 2^MAX_ORDER pages (4MB).
+#define MAX_ORDER   10
+
+// Idle CPUs keep up to PAGE_ZERO_POOL_SIZE zeroed pages ready for
+// page_alloc(ALLOC_ZERO), filling at most PAGE_ZERO_FILL_BATCH per pass.
+#define PAGE_ZERO_POOL_SIZE     64
+#define PAGE_ZERO_FILL_BATCH    8
+
+// A reverse mapping: 'pp_rmap' lists every (pgdir, va) at which a page
+// is mapped through page_insert.
+struct Rmap {
+    pde_t *rm_pgdir;
+    uintptr_t rm_va;
+    struct Rmap *rm_next;
+};
+
+struct PageZeroStats {
+    unsigned pzs_len;       // Pages currently in the pool
+    uint32_t pzs_hits;      // ALLOC_ZERO requests served from the pool
+    uint32_t pzs_misses;    // ALLOC_ZERO requests that zeroed in place
+    uint32_t pzs_filled;    // Pages zeroed by idle CPUs
+};
+
 void    mem_init(void);
 
 void        page_init(void);
 struct Page *page_alloc(int alloc_flags);
 void        page_free(struct Page *pp);
+struct Page *page_alloc_order(int order, int alloc_flags);
+void        page_free_order(struct Page *pp, int order);
+void        page_zero_pool_fill(void);
+bool        page_zero_pool_low(void);
+void        page_zero_pool_stats(struct PageZeroStats *st);
 int         page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
 void        page_remove(pde_t *pgdir, void *va);
+void        page_unmap_all(struct Page *pp);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+int         page_alloc_range(pde_t *pgdir, uintptr_t va, size_t len, int perm);
+int         page_map_range(pde_t *src, pde_t *dst, uintptr_t va, size_t len,
+                           int set, int clear);
+void        page_remove_range(pde_t *pgdir, uintptr_t va, size_t len);
+int         page_cow_range(pde_t *src, pde_t *dst, uintptr_t va, size_t len);
 
 void    page_decref(struct Page *pp);
 void    tlb_invalidate(pde_t *pgdir, void *va);
+void    tlb_flush_global(void);
+void    tlb_batch_begin(pde_t *pgdir);
+void    tlb_batch_end(void);
+void    tlb_shootdown_poll(void);
+void    pmap_load(pde_t *pgdir);
 void *  mmio_map_region(physaddr_t pa, size_t size);
 int user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void    user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int copyin(struct Env *env, void *dst, const void *usrc, size_t len);
+int copyout(struct Env *env, void *udst, const void *src, size_t len);
 
 static inline physaddr_t
 page2pa(struct Page *pp)
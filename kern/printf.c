@@ -4,7 +4,16 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/spinlock.h>
 
+// cons_lock keeps the output of one cprintf together when several CPUs
+// print at once.  A cprintf nested inside another (from a panic, say)
+// just carries on under the outer one's lock.
+static struct spinlock cons_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "cons_lock"
+#endif
+};
 
 static void
 putch(int ch, int *cnt)
@@ -17,8 +26,13 @@ int
 vcprintf(const char *fmt, va_list ap)
 {
     int cnt = 0;
+    bool locked = !holding(&cons_lock);
 
+    if (locked)
+        spin_lock(&cons_lock);
     vprintfmt((void*)putch, &cnt, fmt, ap);
+    if (locked)
+        spin_unlock(&cons_lock);
     return cnt;
 }
 
@@ -1,11 +1,463 @@
 #include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+#include <inc/error.h>
 
 #include <kern/env.h>
+#include <kern/sched.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
 #include <kern/spinlock.h>
+#include <kern/timer.h>
 #include <debug.h>
 
+// Work stealing.  A CPU with an empty run queue takes envs from the
+// busiest peer; a CPU with work only bothers when the peer has at least
+// SCHED_IMBALANCE more queued than it does.  An env that has been stolen
+// must run SCHED_MIGRATE_HOLDOFF times before it can be stolen again, so
+// envs don't bounce back and forth between CPUs.
+#define SCHED_IMBALANCE         2
+#define SCHED_MIGRATE_HOLDOFF   4
+
+// Soft affinity.  An env that becomes runnable goes back on the queue of
+// the CPU it last ran on, where its cache and TLB state may still be
+// warm, unless that CPU has SCHED_AFFINITY_IMBALANCE more envs queued
+// than the CPU waking it.  Hard affinity (env_cpumask) always wins.
+#define SCHED_AFFINITY_IMBALANCE    4
+
+// Multi-level feedback queue.  An env at level 'prio' runs for
+// SCHED_QUANTUM(prio) timer ticks before it is demoted a level, so
+// CPU-bound envs sink and get longer, rarer slices while envs that block
+// quickly stay near the top.  Envs are lifted back to their base level
+// when they block in sys_ipc_recv, and every SCHED_BOOST_TICKS ticks.
+#define SCHED_QUANTUM(prio)     (1 << (prio))
+#define SCHED_BOOST_TICKS       100
+
+// Length of a timer tick, the quantum of a level 0 env, in microseconds.
+// Changed at runtime with sched_set_quantum.
+#define SCHED_TICK_US_DEFAULT   10000
+#define SCHED_TICK_US_MIN       100
+#define SCHED_TICK_US_MAX       1000000
+
+uint32_t sched_quantum_us = SCHED_TICK_US_DEFAULT;
+
+// sched_lock protects every CPU's run queues and the run queue fields of
+// struct Env.  It nests inside env_vm_lock and ipc_lock.
+static struct spinlock sched_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "sched_lock"
+#endif
+};
+
+//
+// Append e to the tail of c's run queue for level e->env_priority.
+//
+static void
+runq_insert(struct Cpu *c, struct Env *e)
+{
+    int prio = e->env_priority;
+
+    e->env_rq_next = NULL;
+    e->env_rq_prev = c->cpu_runq_tail[prio];
+    if (c->cpu_runq_tail[prio])
+        c->cpu_runq_tail[prio]->env_rq_next = e;
+    else
+        c->cpu_runq_head[prio] = e;
+    c->cpu_runq_tail[prio] = e;
+    c->cpu_runq_len++;
+    e->env_rq_cpu = c - cpus;
+    e->env_rq_prio = prio;
+}
+
+static inline bool
+env_cpu_allowed(struct Env *e, struct Cpu *c)
+{
+    return (e->env_cpumask >> (c - cpus)) & 1;
+}
+
+//
+// Choose the CPU whose run queue e should join.
+//
+static struct Cpu *
+sched_target(struct Env *e)
+{
+    struct Cpu *me = thiscpu, *last;
+    int i;
+
+    if (e->env_runs && e->env_cpunum < ncpu) {
+        last = &cpus[e->env_cpunum];
+        if (env_cpu_allowed(e, last) &&
+            (!env_cpu_allowed(e, me) ||
+             last->cpu_runq_len < me->cpu_runq_len + SCHED_AFFINITY_IMBALANCE))
+            return last;
+    }
+    if (env_cpu_allowed(e, me))
+        return me;
+    for (i = 0; i < ncpu; i++)
+        if (env_cpu_allowed(e, &cpus[i]))
+            return &cpus[i];
+    return me;
+}
+
+//
+// Append e to the run queue of the CPU it should run on next.  Does
+// nothing if e is already queued somewhere.
+//
+void
+sched_enqueue(struct Env *e)
+{
+    struct Cpu *c;
+    int i;
+
+    spin_lock(&sched_lock);
+    if (e->env_rq_cpu >= 0) {
+        spin_unlock(&sched_lock);
+        return;
+    }
+
+    c = sched_target(e);
+    runq_insert(c, e);
+
+    // Wake the CPU if it is halted, or make it start a tick if it is
+    // running tickless.  If it is busy and already had work waiting, kick
+    // a halted CPU that may run e, or failing that a tickless one, so it
+    // can steal some.
+    if (c->cpu_status != CPU_HALTED && !c->cpu_tickless &&
+        c->cpu_runq_len > 1) {
+        for (i = 0; i < ncpu; i++)
+            if (cpus[i].cpu_status == CPU_HALTED &&
+                env_cpu_allowed(e, &cpus[i]))
+                break;
+        if (i == ncpu)
+            for (i = 0; i < ncpu; i++)
+                if (cpus[i].cpu_tickless && env_cpu_allowed(e, &cpus[i]))
+                    break;
+        if (i < ncpu)
+            c = &cpus[i];
+    }
+    if (c != thiscpu && (c->cpu_status == CPU_HALTED || c->cpu_tickless))
+        lapic_ipi_dest(c->cpu_id, T_RESCHED);
+    spin_unlock(&sched_lock);
+}
+
+//
+// Remove e from whichever run queue it is on.  Does nothing if e is not
+// queued.
+//
+static void
+runq_remove(struct Env *e)
+{
+    struct Cpu *c;
+    int prio = e->env_rq_prio;
+
+    if (e->env_rq_cpu < 0)
+        return;
+
+    c = &cpus[e->env_rq_cpu];
+    if (e->env_rq_prev)
+        e->env_rq_prev->env_rq_next = e->env_rq_next;
+    else
+        c->cpu_runq_head[prio] = e->env_rq_next;
+    if (e->env_rq_next)
+        e->env_rq_next->env_rq_prev = e->env_rq_prev;
+    else
+        c->cpu_runq_tail[prio] = e->env_rq_prev;
+    c->cpu_runq_len--;
+    e->env_rq_next = e->env_rq_prev = NULL;
+    e->env_rq_cpu = -1;
+}
+
+void
+sched_dequeue(struct Env *e)
+{
+    spin_lock(&sched_lock);
+    runq_remove(e);
+    spin_unlock(&sched_lock);
+}
+
+//
+// Move e to level 'prio' with a fresh quantum, requeueing it on the
+// same CPU if it is queued.
+//
+static void
+runq_set_priority(struct Env *e, int prio)
+{
+    int cpu = e->env_rq_cpu;
+
+    runq_remove(e);
+    e->env_priority = prio;
+    e->env_ticks = SCHED_QUANTUM(prio);
+    if (cpu >= 0)
+        runq_insert(&cpus[cpu], e);
+}
+
+void
+sched_set_priority(struct Env *e, int prio)
+{
+    spin_lock(&sched_lock);
+    runq_set_priority(e, prio);
+    spin_unlock(&sched_lock);
+}
+
+//
+// Return the highest priority env queued on c, or NULL.
+//
+static struct Env *
+runq_first(struct Cpu *c)
+{
+    int prio;
+
+    for (prio = 0; prio < ENV_NPRIO; prio++)
+        if (c->cpu_runq_head[prio])
+            return c->cpu_runq_head[prio];
+    return NULL;
+}
+
+//
+// Lift every env queued on this CPU back to its base level, so CPU-bound
+// envs sitting at the bottom still get to run under a stream of
+// interactive work.
+//
+static void
+sched_boost(void)
+{
+    struct Cpu *c = thiscpu;
+    struct Env *e, *next;
+    int prio;
+
+    spin_lock(&sched_lock);
+    for (prio = 1; prio < ENV_NPRIO; prio++)
+        for (e = c->cpu_runq_head[prio]; e; e = next) {
+            next = e->env_rq_next;
+            if (e->env_prio_base < prio)
+                runq_set_priority(e, e->env_prio_base);
+        }
+    if (curenv && curenv->env_priority > curenv->env_prio_base)
+        runq_set_priority(curenv, curenv->env_prio_base);
+    spin_unlock(&sched_lock);
+}
+
+//
+// Called on every timer interrupt.  Runs the kernel timers that are
+// due.  If curenv's tick is over, charges it to curenv and returns if
+// it should keep running; otherwise calls sched_yield.
+// An env that uses up its whole quantum drops a level.  An env with
+// quantum left is preempted only by a higher priority env queued here.
+//
+void
+sched_tick(void)
+{
+    struct Env *e = curenv, *next;
+
+    // The interrupt may be for a kernel timer rather than the end of
+    // the tick.
+    thiscpu->cpu_timer_deadline = 0;
+    timer_run();
+    if (!thiscpu->cpu_tick_end || read_tsc() < thiscpu->cpu_tick_end)
+        return;
+    thiscpu->cpu_tick_end = 0;
+
+    if (++thiscpu->cpu_ticks >= SCHED_BOOST_TICKS) {
+        thiscpu->cpu_ticks = 0;
+        sched_boost();
+    }
+
+    if (!e || e->env_status != ENV_RUNNING || !env_cpu_allowed(e, thiscpu))
+        sched_yield();
+
+    if (e->env_ticks > 1) {
+        e->env_ticks--;
+        next = runq_first(thiscpu);
+        if (!next || next->env_priority >= e->env_priority)
+            return;
+    } else {
+        sched_set_priority(e, MIN(e->env_priority + 1, ENV_NPRIO - 1));
+    }
+    sched_yield();
+}
+
+//
+// Dynamic ticks.  Start a tick for curenv if something may need to
+// preempt it: an env queued on this CPU, enough queued on another that
+// we should come and steal, or curenv being pinned away from here.
+// Otherwise let it run tickless, with
+// the LAPIC timer armed only for kernel timers, until sched_enqueue
+// sends us a T_RESCHED.
+//
+void
+sched_tick_start(void)
+{
+    struct Cpu *c = thiscpu;
+    bool need;
+    int i;
+
+    spin_lock(&sched_lock);
+    need = c->cpu_runq_len > 0 ||
+        (curenv && !env_cpu_allowed(curenv, c));
+    for (i = 0; i < ncpu && !need; i++)
+        need = cpus[i].cpu_runq_len >= SCHED_IMBALANCE;
+    c->cpu_tickless = !need;
+    spin_unlock(&sched_lock);
+
+    if (need)
+        c->cpu_tick_end = read_tsc() +
+            (uint64_t) sched_quantum_us * tsc_khz / 1000;
+}
+
+//
+// Program this CPU's LAPIC timer for the end of the running env's tick
+// or the next kernel timer, whichever comes first.  Leaves it alone if
+// it will already go off by then.
+//
+void
+sched_timer_arm(void)
+{
+    struct Cpu *c = thiscpu;
+    uint64_t now = read_tsc(), when = c->cpu_tick_end, t;
+    uint32_t us = timer_next_us();
+
+    if (us) {
+        t = now + (uint64_t) us * tsc_khz / 1000;
+        if (!when || t < when)
+            when = t;
+    }
+    if (!when || (c->cpu_timer_deadline && c->cpu_timer_deadline <= when))
+        return;
+    c->cpu_timer_deadline = when;
+    lapic_timer_arm(when > now ? (when - now) * 1000 / tsc_khz : 0);
+}
+
+//
+// Set the length of a timer tick to us microseconds.  CPUs pick the new
+// length up the next time they arm their timers.
+//
+int
+sched_set_quantum(uint32_t us)
+{
+    if (us < SCHED_TICK_US_MIN || us > SCHED_TICK_US_MAX)
+        return -E_INVAL;
+    sched_quantum_us = us;
+    return 0;
+}
+
+//
+// Move envs from the busiest other CPU's run queue to ours if the two
+// are far enough out of balance.  Takes half the difference, at least
+// one env if our queue is empty, starting with the envs that have waited
+// longest (and so have the coldest caches).  The caller holds
+// sched_lock.
+//
+static void
+sched_steal(void)
+{
+    struct Cpu *me = thiscpu, *busiest = NULL;
+    struct Env *e, *next;
+    unsigned nmove;
+    int i, prio;
+
+    for (i = 0; i < ncpu; i++)
+        if (&cpus[i] != me && cpus[i].cpu_runq_len &&
+            (!busiest || cpus[i].cpu_runq_len > busiest->cpu_runq_len))
+            busiest = &cpus[i];
+
+    if (!busiest)
+        return;
+    if (me->cpu_runq_len &&
+        busiest->cpu_runq_len < me->cpu_runq_len + SCHED_IMBALANCE)
+        return;
+
+    nmove = (busiest->cpu_runq_len - me->cpu_runq_len) / 2;
+    if (nmove == 0)
+        nmove = 1;
+
+    for (prio = 0; prio < ENV_NPRIO && nmove > 0; prio++)
+        for (e = busiest->cpu_runq_head[prio]; e && nmove > 0; e = next) {
+            next = e->env_rq_next;
+            if (!env_cpu_allowed(e, me))
+                continue;
+            if (e->env_runs &&
+                e->env_runs - e->env_migrate_runs < SCHED_MIGRATE_HOLDOFF)
+                continue;
+            runq_remove(e);
+            runq_insert(me, e);
+            e->env_migrate_runs = e->env_runs;
+            nmove--;
+        }
+}
+
+//
+// Return true if any env is queued or running on another CPU, or a
+// kernel timer is pending that may wake one, so the system still has
+// work to do.
+//
+static bool
+sched_live(void)
+{
+    int i;
+
+    if (timer_next_us())
+        return 1;
+    for (i = 0; i < ncpu; i++)
+        if (cpus[i].cpu_runq_len || (&cpus[i] != thiscpu && cpus[i].cpu_env))
+            return 1;
+    return 0;
+}
+
+//
+// Nothing to run here: give up the kernel lock and halt until an
+// interrupt arrives.  sched_enqueue sends a T_RESCHED IPI to a halted
+// CPU when it queues an env for it; trap() takes the kernel lock back
+// on the way in.  Does not return.
+//
+static void __attribute__((noreturn))
+sched_halt(void)
+{
+    // Switch to kern_pgdir: curenv may be freed while we are away.
+    curenv = NULL;
+    pmap_load(kern_pgdir);
+    // Wake up for the next kernel timer, if any.
+    thiscpu->cpu_tick_end = 0;
+    thiscpu->cpu_tickless = 0;
+    sched_timer_arm();
+    xchg(&thiscpu->cpu_status, CPU_HALTED);
+    unlock_kernel();
+
+    // Use the time to zero pages for page_alloc(ALLOC_ZERO).  That
+    // only needs page_lock.
+    if (page_zero_pool_low())
+        page_zero_pool_fill();
+
+    // Reset the stack pointer, enable interrupts and then halt.
+    asm volatile (
+        "movl $0, %%ebp\n"
+        "movl %0, %%esp\n"
+        "pushl $0\n"
+        "pushl $0\n"
+        "sti\n"
+        "1:\n"
+        "hlt\n"
+        "jmp 1b\n"
+    : : "a" (thiscpu->cpu_ts.ts_esp0));
+    panic("sched_halt: hlt loop returned");
+}
+
+//
+// Return the first env of the highest non-empty level of this CPU's run
+// queue, after balancing
+// against the other CPUs.  NULL if there is nothing for us to run.
+//
+static struct Env *
+sched_pick(void)
+{
+    struct Env *e;
+
+    spin_lock(&sched_lock);
+    sched_steal();
+    e = runq_first(thiscpu);
+    spin_unlock(&sched_lock);
+    return e;
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
@@ -13,28 +465,22 @@ sched_yield(void)
     if(!holding(&kernel_lock))
         lock_kernel();
 
-    struct Env *idle;
-    int i;
+    struct Env *e;
 
-    // Implement simple round-robin scheduling.
+    // Round-robin within priority levels.
     //
-    // Search through 'envs' for an ENV_RUNNABLE environment in
-    // circular fashion starting just after the env this CPU was
-    // last running.  Switch to the first such environment found.
+    // Every ENV_RUNNABLE env sits on one CPU's run queue at its
+    // env_priority level; env_run takes the env it starts off its queue
+    // and puts the env it preempts back on the tail of this CPU's.  So
+    // the head of our highest non-empty level is the best env to run
+    // here, and picking it costs O(NCPU + ENV_NPRIO) however many envs
+    // exist.  Envs running on other CPUs are ENV_RUNNING and never on a
+    // queue.
     //
     // If no envs are runnable, but the environment previously
     // running on this CPU is still ENV_RUNNING, it's okay to
-    // choose that environment.
-    //
-    // Never choose an environment that's currently running on
-    // another CPU (env_status == ENV_RUNNING) and never choose an
-    // idle environment (env_type == ENV_TYPE_IDLE).  If there are
-    // no runnable environments, simply drop through to the code
-    // below to switch to this CPU's idle environment.
-
-    // LAB 4: Your code here.
-    int c = (curenv ? curenv->env_id : 0) % NENV;
-    i = (c + 1) % NENV;
+    // choose that environment.  Otherwise halt this CPU until there
+    // is work for it.
 
     if(curenv && curenv->env_escape_preempt > 0) {
         if(curenv->env_escape_preempt != 0xBAD1DEA)
@@ -43,27 +489,24 @@ sched_yield(void)
         env_run(curenv);
     }
 
-    while(i != c) {
-        if ((envs[i].env_type != ENV_TYPE_IDLE) &&
-            (envs[i].env_status == ENV_RUNNABLE)) {
-            KDEBUG("env %08x launching env %08x\n", c, envs[i].env_id);
-            env_run(&envs[i]);
-        } else { 
-            i = (i + 1) % NENV;
-        }
+    // curenv may have been pinned away from this CPU while it ran.
+    if (curenv && curenv->env_status == ENV_RUNNING &&
+        !env_cpu_allowed(curenv, thiscpu))
+        env_set_status(curenv, ENV_RUNNABLE);
+
+    if ((e = sched_pick()) != NULL) {
+        KDEBUG("env %08x launching env %08x\n",
+               curenv ? curenv->env_id : 0, e->env_id);
+        env_run(e);
     }
     
-    if(curenv && (curenv->env_status == ENV_RUNNING && curenv->env_type != ENV_TYPE_IDLE)) {
+    if(curenv && curenv->env_status == ENV_RUNNING) {
         env_run(curenv);
-    } else if (cpunum() == 0) {
+    } else if (cpunum() == 0 && !sched_live()) {
         K_DEBUG("No more runnable environments!");
         while (1)
             monitor(NULL);
     } else {
-        // Run this CPU's idle environment when nothing else is runnable.
-        idle = &envs[cpunum()];
-        if (!(idle->env_status == ENV_RUNNABLE || idle->env_status == ENV_RUNNING))
-            panic("CPU %d: No idle environment!", cpunum());
-        env_run(idle);
+        sched_halt();
     }
 }
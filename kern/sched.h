@@ -6,7 +6,18 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
+extern uint32_t sched_quantum_us;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_set_priority(struct Env *e, int prio);
+void sched_tick(void);
+void sched_tick_start(void);
+void sched_timer_arm(void);
+int sched_set_quantum(uint32_t us);
 
 #endif  // !JOS_KERN_SCHED_H
@@ -7,6 +7,7 @@
 #include <inc/string.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/pmap.h>
 #include <kern/kdebug.h>
 
 // The big kernel lock
@@ -43,10 +44,150 @@ holding(struct spinlock *lock)
 }
 #endif
 
+//
+// Atomic helpers for the lock implementations.
+//
+static inline uint32_t
+fetch_and_add(volatile uint32_t *addr, uint32_t v)
+{
+    asm volatile("lock; xaddl %0, %1"
+                 : "+r" (v), "+m" (*addr) : : "memory");
+    return v;
+}
+
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t old, uint32_t new)
+{
+    uint32_t prev;
+
+    asm volatile("lock; cmpxchgl %2, %1"
+                 : "=a" (prev), "+m" (*addr) : "r" (new), "0" (old) : "memory");
+    return prev;
+}
+
+// Called on every turn of a wait loop.  Keep answering TLB shootdowns
+// while we wait: the holder may be waiting on us, and interrupts are off
+// in the kernel.
+static inline void
+spin_wait(void)
+{
+    tlb_shootdown_poll();
+    asm volatile ("pause");
+}
+
+#if SPINLOCK_IMPL == SPINLOCK_MCS
+// An MCS waiter.  Each CPU has a few, since it can hold several locks at
+// once; interrupts are off in the kernel, so only that CPU touches them.
+struct McsNode {
+    struct McsNode *volatile next;  // The waiter queued behind us
+    volatile uint32_t waiting;      // Cleared by our predecessor
+    uint32_t busy;                  // In use by a held or awaited lock
+};
+
+#define MCS_NODES   8
+static struct McsNode mcs_nodes[NCPU][MCS_NODES];
+
+static struct McsNode *
+mcs_node_get(void)
+{
+    struct McsNode *n = mcs_nodes[cpunum()];
+    int i;
+
+    for (i = 0; i < MCS_NODES; i++)
+        if (!n[i].busy) {
+            n[i].busy = 1;
+            return &n[i];
+        }
+    panic("CPU %d holds too many MCS locks", cpunum());
+}
+#endif
+
+#ifdef LOCKSTAT
+// Every lock that has ever been acquired, most recent first.
+static struct spinlock *lockstat_list;
+
+//
+// Account an acquisition of lk, which we now hold, that started
+// waiting at TSC 'start' from the call site 'pc'.
+//
+static void
+lockstat_acquired(struct spinlock *lk, uint64_t start, bool waited,
+                  uintptr_t pc)
+{
+    uint64_t now = read_tsc(), wait = now - start;
+    struct spinlock *head;
+
+    lk->ls_acquires++;
+    if (waited) {
+        lk->ls_contended++;
+        lk->ls_wait += wait;
+        if (wait > lk->ls_max_wait) {
+            lk->ls_max_wait = wait;
+            lk->ls_max_wait_pc = pc;
+        }
+    }
+    lk->ls_start = now;
+
+    if (!lk->ls_listed) {
+        lk->ls_listed = 1;
+        do {
+            head = lockstat_list;
+            lk->ls_next = head;
+        } while (cmpxchg((volatile uint32_t *) &lockstat_list,
+                         (uint32_t) head, (uint32_t) lk) != (uint32_t) head);
+    }
+}
+
+//
+// Store up to n of the locks that have spent the most cycles waiting in
+// locks[], hottest first.  Returns how many were stored.
+//
+int
+lockstat_hottest(struct spinlock **locks, int n)
+{
+    struct spinlock *lk;
+    int i, len = 0;
+
+    for (lk = lockstat_list; lk; lk = lk->ls_next) {
+        for (i = len; i > 0 && locks[i - 1]->ls_wait < lk->ls_wait; i--)
+            if (i < n)
+                locks[i] = locks[i - 1];
+        if (i < n) {
+            locks[i] = lk;
+            if (len < n)
+                len++;
+        }
+    }
+    return len;
+}
+
+//
+// Zero the counters of every lock.  Racy against the holders, so the
+// first numbers after a reset may be slightly off.
+//
+void
+lockstat_reset(void)
+{
+    struct spinlock *lk;
+
+    for (lk = lockstat_list; lk; lk = lk->ls_next) {
+        lk->ls_acquires = lk->ls_contended = 0;
+        lk->ls_wait = lk->ls_hold = lk->ls_max_wait = 0;
+        lk->ls_max_wait_pc = 0;
+    }
+}
+#endif
+
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
     lk->locked = 0;
+#if SPINLOCK_IMPL == SPINLOCK_TICKET
+    lk->next = lk->owner = 0;
+#elif SPINLOCK_IMPL == SPINLOCK_MCS
+    lk->tail = NULL;
+    lk->node = NULL;
+#endif
 #ifdef DEBUG_SPINLOCK
     lk->name = name;
     lk->cpu = 0;
@@ -60,20 +201,60 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+    bool waited = 0;
+#ifdef LOCKSTAT
+    uint64_t start = read_tsc();
+#endif
+
 #ifdef DEBUG_SPINLOCK
     if (holding(lk))
         panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
+#if SPINLOCK_IMPL == SPINLOCK_TICKET
+    // Take a ticket and wait for it to come up.  The locked xadd
+    // serializes, so reads after acquire are not reordered before it.
+    uint32_t ticket = fetch_and_add(&lk->next, 1);
+    while (lk->owner != ticket) {
+        waited = 1;
+        spin_wait();
+    }
+    lk->locked = 1;
+#elif SPINLOCK_IMPL == SPINLOCK_MCS
+    // Join the queue, then spin on our own node until our predecessor
+    // hands the lock over.
+    struct McsNode *node = mcs_node_get(), *prev;
+
+    node->next = NULL;
+    node->waiting = 1;
+    prev = (struct McsNode *) xchg((volatile uint32_t *) &lk->tail,
+                                   (uint32_t) node);
+    if (prev) {
+        prev->next = node;
+        while (node->waiting) {
+            waited = 1;
+            spin_wait();
+        }
+    }
+    lk->node = node;
+    lk->locked = 1;
+#else
     // The xchg is atomic.
     // It also serializes, so that reads after acquire are not
     // reordered before it. 
-    while (xchg(&lk->locked, 1) != 0)
-        asm volatile ("pause");
+    while (xchg(&lk->locked, 1) != 0) {
+        waited = 1;
+        spin_wait();
+    }
+#endif
+
+#ifdef LOCKSTAT
+    lockstat_acquired(lk, start, waited,
+                      (uintptr_t) __builtin_return_address(0));
+#endif
 
     // Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
-//    cprintf("CPU %d has aquired lock %s\n", cpunum(), lk->name);
     lk->cpu = thiscpu;
     get_caller_pcs(lk->pcs);
 #endif
@@ -108,6 +289,33 @@ spin_unlock(struct spinlock *lk)
     lk->cpu = 0;
 #endif
 
+#ifdef LOCKSTAT
+    lk->ls_hold += read_tsc() - lk->ls_start;
+#endif
+
+#if SPINLOCK_IMPL == SPINLOCK_TICKET
+    // Only the holder writes owner; the xchg orders the critical
+    // section's reads and writes before the hand-off.
+    lk->locked = 0;
+    xchg(&lk->owner, lk->owner + 1);
+#elif SPINLOCK_IMPL == SPINLOCK_MCS
+    struct McsNode *node = lk->node;
+
+    lk->locked = 0;
+    if (!node->next) {
+        // Nobody queued behind us: try to mark the lock free.
+        if (cmpxchg((volatile uint32_t *) &lk->tail,
+                    (uint32_t) node, 0) == (uint32_t) node) {
+            node->busy = 0;
+            return;
+        }
+        // Somebody is between the xchg and linking in.
+        while (!node->next)
+            asm volatile ("pause");
+    }
+    xchg(&node->next->waiting, 0);
+    node->busy = 0;
+#else
     // The xchg serializes, so that reads before release are 
     // not reordered after it.  The 1996 PentiumPro manual (Volume 3,
     // 7.2) says reads can be carried out speculatively and in
@@ -118,5 +326,5 @@ spin_unlock(struct spinlock *lk)
     // The xchg being asm volatile ensures gcc emits it after
     // the above assignments (and after the critical section).
     xchg(&lk->locked, 0);
-//    cprintf("CPU %d has freed lock %s\n", cpunum(), lk->name);
+#endif
 }
@@ -6,10 +6,36 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Spinlock implementation.  Pick one of:
+//   SPINLOCK_TAS     test-and-set on 'locked'.  Unfair, and every waiter
+//                    hammers the lock's cache line.
+//   SPINLOCK_TICKET  FIFO ticket lock.  Fair, but waiters still all spin
+//                    on the same line.
+//   SPINLOCK_MCS     queue lock: each waiter spins on its own node and
+//                    the holder hands the lock straight to the next.
+#define SPINLOCK_TAS        0
+#define SPINLOCK_TICKET     1
+#define SPINLOCK_MCS        2
+#define SPINLOCK_IMPL       SPINLOCK_TICKET
+
+// Comment this to stop counting acquisitions, contention and hold times
+// (in TSC cycles) for every lock.  See the lockstat monitor command.
+#define LOCKSTAT
+
+struct McsNode;
+
 // Mutual exclusion lock.
 struct spinlock {
     unsigned locked;   // Is the lock held?
 
+#if SPINLOCK_IMPL == SPINLOCK_TICKET
+    volatile uint32_t next;     // Next ticket to hand out
+    volatile uint32_t owner;    // Ticket now being served
+#elif SPINLOCK_IMPL == SPINLOCK_MCS
+    struct McsNode *volatile tail;  // Last waiter in the queue, or NULL
+    struct McsNode *node;       // The holder's queue node
+#endif
+
 #ifdef DEBUG_SPINLOCK
     // For debugging:
     char *name;        // Name of lock.
@@ -17,6 +43,19 @@ struct spinlock {
     uintptr_t pcs[10]; // The call stack (an array of program counters)
                        // that locked the lock.
 #endif
+
+#ifdef LOCKSTAT
+    // Updated only by the holder.
+    uint64_t ls_acquires;       // Times acquired
+    uint64_t ls_contended;      // Acquisitions that had to wait
+    uint64_t ls_wait;           // Cycles spent waiting
+    uint64_t ls_hold;           // Cycles held
+    uint64_t ls_max_wait;       // Longest single wait
+    uintptr_t ls_max_wait_pc;   // Where that wait happened
+    uint64_t ls_start;          // When the current holder got the lock
+    struct spinlock *ls_next;   // Next lock on the lockstat list
+    uint32_t ls_listed;         // Is the lock on the lockstat list?
+#endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
@@ -25,6 +64,11 @@ void spin_unlock(struct spinlock *lk);
 int  holding(struct spinlock *lk);
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
+#ifdef LOCKSTAT
+int  lockstat_hottest(struct spinlock **locks, int n);
+void lockstat_reset(void);
+#endif
+
 extern struct spinlock kernel_lock;
 
 static inline void
@@ -10,9 +10,19 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
 
 #include <debug.h>
 
+// ipc_lock protects the env_ipc_* fields of every env, so a sender sees
+// a receiver's env_ipc_recving and env_ipc_dstva change together.
+static struct spinlock ipc_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "ipc_lock"
+#endif
+};
+
 #define ZERO_CALL_SUPPORT(x)                            \
 do {                                                    \
     if(x == 0) {                                        \
@@ -35,6 +45,28 @@ sys_cputs(const char *s, size_t len)
     cprintf("%.*s", len, s);
 }
 
+// sys_cputs without the kernel lock.  The string is copied out through
+// copyin a chunk at a time, which never faults even if another CPU
+// unmaps the pages meanwhile.  Returns false, having printed nothing, if
+// the string is bad, so that the caller can fall back to sys_cputs.
+static bool
+sys_cputs_nolock(const char *s, size_t len)
+{
+    char buf[128];
+    size_t n;
+
+    if(user_mem_check(curenv, s, len, PTE_U) < 0)
+        return 0;
+
+    for(; len; s += n, len -= n) {
+        n = MIN(len, sizeof(buf));
+        if(copyin(curenv, buf, s, n) < 0)
+            break;
+        cprintf("%.*s", n, buf);
+    }
+    return 1;
+}
+
 // Read a character from the system console without blocking.
 // Returns the character, or 0 if there is no input waiting.
 static int
@@ -96,7 +128,7 @@ sys_exofork(void)
 
     // LAB 4: Your code here.
     struct Env* e;
-    unsigned res = env_alloc(&e, curenv->env_id);
+    int res = env_alloc(&e, curenv->env_id);
     if(res < 0) {
         if(res == -E_NO_FREE_ENV) {
             K_DEBUG("no free envs!\n");
@@ -104,15 +136,67 @@ sys_exofork(void)
             K_DEBUG("no free mem!\n");
         } return res; // -E_NO_FREE_ENV, -E_NO_MEM
     }
-    e->env_status = ENV_NOT_RUNNABLE;
+    env_set_status(e, ENV_NOT_RUNNABLE);
     e->env_type   = ENV_TYPE_USER;
     e->env_tf = curenv->env_tf;                 // copy register state
     K_DEBUG("child epi %08x\n",
             e->env_tf.tf_eip);
     e->env_tf.tf_regs.reg_eax = 0;              // set child return code
+    e->env_prio_base = curenv->env_prio_base;
+    e->env_cpumask = curenv->env_cpumask;
+    sched_set_priority(e, e->env_prio_base);
     return e->env_id;                           // return the child's env. id
 }
 
+// Fork the caller: create a runnable child whose address space is a
+// copy-on-write copy of the caller's from UTEXT up, demand-zero regions
+// included, and which returns 0 from this call.  Writable pages become PTE_COW in both.  The user
+// exception stack is never copy-on-write; the child gets its own copy
+// of it, and the caller's page fault upcall.
+//
+// Returns the child's envid, or < 0 on error.  Errors are:
+//  -E_NO_FREE_ENV if no free environment is available.
+//  -E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+    struct Env *e;
+    struct Page *pp, *xpp;
+    envid_t envid;
+    int res;
+
+    if((envid = sys_exofork()) < 0)
+        return envid;
+    e = &envs[ENVX(envid)];
+    e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    // The copy's untouched demand-zero pages stay demand-zero.
+    memmove(e->env_regions, curenv->env_regions, sizeof(e->env_regions));
+
+    env_vm_lock2(curenv, e);
+    res = page_cow_range(curenv->env_pgdir, e->env_pgdir, UTEXT,
+                         UXSTACKTOP - PGSIZE - UTEXT);
+    xpp = page_lookup(curenv->env_pgdir, (void *) (UXSTACKTOP - PGSIZE), NULL);
+    if(res == 0 && xpp) {
+        if(!(pp = page_alloc(0)))
+            res = -E_NO_MEM;
+        else {
+            memmove(page2kva(pp), page2kva(xpp), PGSIZE);
+            res = page_insert(e->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE),
+                              PTE_P | PTE_U | PTE_W);
+            if(res < 0)
+                page_free(pp);
+        }
+    }
+    env_vm_unlock2(curenv, e);
+
+    if(res < 0) {
+        env_destroy(e);
+        return res;
+    }
+    env_set_status(e, ENV_RUNNABLE);
+    return envid;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -142,24 +226,13 @@ sys_env_set_status(envid_t envid, int status)
         return -E_INVAL;
     }
 
-    if(e->env_type == ENV_TYPE_IDLE) {
-        if((status == ENV_DYING) ||
-           (status == ENV_RUNNABLE)) {
-            // This code prevents users from setting idle environments'
-            // status flags to the following values:
-            //  - ENV_DYING     a user shouldn't be able to kill a kernel env
-            //  - ENV_RUINNABLE idle envs can only be entered by the kernel
-            K_DEBUG("ERROR: cannot set status of an idle env\n");
-            return -E_INVAL;
-        }
-    } 
     if(e->env_type == ENV_TYPE_USER) {
         if((status == ENV_DYING)        ||
            (status == ENV_RUNNABLE)     ||
            (status == ENV_RUNNING)      ||
            (status == ENV_NOT_RUNNABLE)) {
             // if the status is legal...
-            e->env_status = status;
+            env_set_status(e, status);
             return 0;
         } else {
             // don't let envs enter states which aren't valid states
@@ -179,6 +252,7 @@ sys_env_set_status(envid_t envid, int status)
 // Returns 0 on success, < 0 on error.  Errors are:
 //  -E_BAD_ENV if environment envid doesn't currently exist,
 //      or the caller doesn't have permission to change envid.
+//  -E_FAULT if tf is not readable by the caller.
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -196,8 +270,12 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
        (curenv->env_id != t_e->env_id))
       return -E_BAD_ENV;
     
-    tf->tf_cs |= 3;
-    memcpy(&t_e->env_tf, tf, sizeof(struct Trapframe));
+    struct Trapframe ktf;
+    if(copyin(curenv, &ktf, tf, sizeof(struct Trapframe)) < 0)
+      return -E_FAULT;
+
+    ktf.tf_cs |= 3;
+    t_e->env_tf = ktf;
 
     return 0;
 }
@@ -306,7 +384,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 
     if((p = page_alloc(ALLOC_ZERO))) {
         // nonzero return value, all is well so far
+        env_vm_lock(target);
         int i = page_insert(target->env_pgdir, p, va, PTE_P | PTE_U | perm);
+        env_vm_unlock(target);
         if(i == 0) {
             // all is well
             K_DEBUG("insert returned %d, all well\n", i);
@@ -323,6 +403,43 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     }
 }
 
+// Reserve [va, va+len) in envid's address space as a demand-zero
+// region: each page is allocated, zeroed and mapped with 'perm' by the
+// kernel the first time it is touched, with no page fault upcall.
+// len is rounded up to a multiple of PGSIZE.  Pages already mapped in
+// the range are left alone.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//  -E_BAD_ENV if environment envid doesn't currently exist,
+//      or the caller doesn't have permission to change envid.
+//  -E_INVAL if va is not page-aligned, len is 0, or the range extends
+//      above UTOP or overlaps one of envid's regions.
+//  -E_INVAL if perm is inappropriate (see sys_page_alloc).
+//  -E_NO_MEM if envid already has NENVREGION regions.
+static int
+sys_region_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+    struct Env *target;
+    int res;
+
+    if((res = envid2env(envid, &target, 1)) < 0)
+        return res;
+
+    if((perm ^ (PTE_AVAIL | PTE_W)) & ~(PTE_W | PTE_AVAIL | PTE_U | PTE_P)) {
+        K_DEBUG("ERROR: the permission bits are off\n");
+        return -E_INVAL;
+    }
+
+    len = ROUNDUP(len, PGSIZE);
+    if(((unsigned) va % PGSIZE) != 0 || len == 0
+       || (unsigned) va >= UTOP || len > UTOP - (unsigned) va) {
+        K_DEBUG("ERROR: bad region %08x+%x\n", va, len);
+        return -E_INVAL;
+    }
+
+    return env_region_reserve(target, (uintptr_t) va, len, perm);
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -377,12 +494,16 @@ sys_page_map(envid_t srcenvid, void *srcva,
     }
 
     pte_t *pte;
+    env_vm_lock2(src, dst);
     struct Page *page = page_lookup(src->env_pgdir, srcva, &pte);
     if(!page) {
+        env_vm_unlock2(src, dst);
         return -E_INVAL;
     }
 
-    return page_insert(dst->env_pgdir, page, dstva, PTE_P | PTE_U | perm);
+    res = page_insert(dst->env_pgdir, page, dstva, PTE_P | PTE_U | perm);
+    env_vm_unlock2(src, dst);
+    return res;
 
 }
 
@@ -411,7 +532,120 @@ sys_page_unmap(envid_t envid, void *va)
         // not page alligned
         return -E_INVAL;
 
+    env_vm_lock(env);
     page_remove(env->env_pgdir, va);
+    env_vm_unlock(env);
+    return 0;
+}
+
+// Whether [va, va+len) is a page-aligned range below UTOP.
+static bool
+page_range_ok(void *va, size_t len)
+{
+    return PGOFF(va) == 0 && PGOFF(len) == 0 &&
+           (uintptr_t) va < UTOP && len <= UTOP - (uintptr_t) va;
+}
+
+// sys_page_alloc for every page of [va, va+len), with one TLB
+// shootdown for the lot.  If it fails part way, the pages before the
+// failure stay allocated.
+//
+// Return 0 on success, < 0 on error.  Errors are as for
+// sys_page_alloc, plus:
+//  -E_INVAL if len is not page-aligned or the range extends above UTOP.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+    struct Env *env;
+    int res;
+
+    if((res = envid2env(envid, &env, 1)) < 0)
+        return res;
+
+    if((perm ^ (PTE_AVAIL | PTE_W)) & ~(PTE_W | PTE_AVAIL | PTE_U | PTE_P))
+        return -E_INVAL;
+    if(!page_range_ok(va, len))
+        return -E_INVAL;
+
+    env_vm_lock(env);
+    res = page_alloc_range(env->env_pgdir, (uintptr_t) va, len,
+                           PTE_P | PTE_U | perm);
+    env_vm_unlock(env);
+    return res;
+}
+
+// Map every page of [va, va+len) in srcenvid's address space at the
+// same address in dstenvid's, with one TLB shootdown for the lot.
+// Pages not mapped in srcenvid are skipped.  'perm' is either as for
+// sys_page_map, or PERM_CHANGE(set, clear) to keep each page's own
+// permissions but for the bits in clear and set, such as
+// PERM_CHANGE(PTE_COW, PTE_W) to make the mappings copy-on-write.
+// If it fails part way, the pages before the failure stay mapped.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//  -E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//      or the caller doesn't have permission to change one of them.
+//  -E_INVAL if va or len is not page-aligned, or the range extends
+//      above UTOP.
+//  -E_INVAL if perm is inappropriate, or PERM_CHANGE would set or
+//      clear bits outside PTE_SYSCALL, or clear PTE_P or PTE_U.
+//  -E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_page_map_range(envid_t srcenvid, envid_t dstenvid, void *va, size_t len,
+                   uint32_t perm)
+{
+    struct Env *src, *dst;
+    int res, set, clear;
+
+    if((res = envid2env(srcenvid, &src, 1)) < 0)
+        return res;
+    if((res = envid2env(dstenvid, &dst, 1)) < 0)
+        return res;
+
+    if(perm & PERM_UPDATE) {
+        set = perm & 0xfff;
+        clear = (perm >> 12) & 0xfff;
+        if((perm & ~(PERM_UPDATE | 0xffffff)) || ((set | clear) & ~PTE_SYSCALL)
+           || (clear & (PTE_P | PTE_U)))
+            return -E_INVAL;
+    } else {
+        if((perm ^ (PTE_AVAIL | PTE_W)) & ~(PTE_W | PTE_AVAIL | PTE_U | PTE_P))
+            return -E_INVAL;
+        set = PTE_P | PTE_U | perm;
+        clear = PTE_SYSCALL;
+    }
+    if(!page_range_ok(va, len))
+        return -E_INVAL;
+
+    env_vm_lock2(src, dst);
+    res = page_map_range(src->env_pgdir, dst->env_pgdir, (uintptr_t) va, len,
+                         set, clear);
+    env_vm_unlock2(src, dst);
+    return res;
+}
+
+// sys_page_unmap for every page of [va, va+len), with one TLB
+// shootdown for the lot.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//  -E_BAD_ENV if environment envid doesn't currently exist,
+//      or the caller doesn't have permission to change envid.
+//  -E_INVAL if va or len is not page-aligned, or the range extends
+//      above UTOP.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+    struct Env *env;
+    int res;
+
+    if((res = envid2env(envid, &env, 1)) < 0)
+        return res;
+    if(!page_range_ok(va, len))
+        return -E_INVAL;
+
+    env_vm_lock(env);
+    page_remove_range(env->env_pgdir, (uintptr_t) va, len);
+    env_vm_unlock(env);
     return 0;
 }
 
@@ -465,12 +699,11 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     struct Page * page;
     pte_t * pte;
 
+    int result;
+
     if(envid2env(envid, &env, 0) < 0)
         return -E_BAD_ENV;
 
-    if(env->env_ipc_recving == 0)
-        return -E_IPC_NOT_RECV;
-
     if(srcva && (uintptr_t) srcva < UTOP){
         if((uintptr_t) srcva % PGSIZE)
             return -E_INVAL;
@@ -482,16 +715,25 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
             return -E_INVAL;
     }
 
+    spin_lock(&ipc_lock);
+    if(env->env_ipc_recving == 0) {
+        spin_unlock(&ipc_lock);
+        return -E_IPC_NOT_RECV;
+    }
+
     if(srcva && env->env_ipc_dstva && ((uintptr_t) srcva < UTOP)){
+        env_vm_lock2(curenv, env);
         if((page = page_lookup(curenv->env_pgdir, srcva, &pte)) == NULL)
-            return -E_INVAL;
-
-        if((perm & PTE_W) && !(*pte & PTE_W))
+            result = -E_INVAL;
+        else if((perm & PTE_W) && !(*pte & PTE_W))
             panic("Are you sure you want to mapping a read-only page to a status that can be written?");
-
-        int result = page_insert(env->env_pgdir, page, env->env_ipc_dstva, perm);
-        if(result < 0)
+        else
+            result = page_insert(env->env_pgdir, page, env->env_ipc_dstva, perm);
+        env_vm_unlock2(curenv, env);
+        if(result < 0) {
+            spin_unlock(&ipc_lock);
             return result;
+        }
 
         env->env_ipc_perm = perm;
     }
@@ -502,13 +744,47 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     env->env_ipc_recving  = 0;
     env->env_ipc_from     = sys_getenvid();
     env->env_ipc_value    = value;
-    env->env_status       = ENV_RUNNABLE;
+    env_set_status(env, ENV_RUNNABLE);
+    spin_unlock(&ipc_lock);
 
     KDEBUG("\e[0;31m%08x unblocked\e[0;00m\n", env->env_id);
 
     return 0;
 }
 
+// Wake an env from sys_sleep, or fail its sys_ipc_recv with -E_TIMEOUT,
+// when its timer fires.
+static void
+env_timeout(void *arg)
+{
+    struct Env *e = arg;
+
+    spin_lock(&ipc_lock);
+    if (e->env_status == ENV_NOT_RUNNABLE) {
+        if (e->env_ipc_recving) {
+            e->env_ipc_recving = 0;
+            e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+        }
+        env_set_status(e, ENV_RUNNABLE);
+    }
+    spin_unlock(&ipc_lock);
+}
+
+// Block for at least 'us' microseconds.  The env is off the run queues
+// until its timer fires, or somebody makes it runnable first.
+//
+// Returns 0.
+static int
+sys_sleep(uint32_t us)
+{
+    struct Timer *t = env_timer(curenv);
+
+    timer_init(t, env_timeout, curenv);
+    timer_add(t, us);
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    return 0;
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -516,30 +792,217 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If 'timeout_us' is nonzero, give up waiting after that many
+// microseconds.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //  -E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//  -E_TIMEOUT (eventually) if nothing arrived within timeout_us.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t timeout_us)
 {
+    struct Timer *t;
+
     // LAB 4: Your code here.
     if((uintptr_t) dstva < UTOP && ((uintptr_t) dstva % PGSIZE)) {
         return -E_INVAL;
     }
 
+    spin_lock(&ipc_lock);
     curenv->env_ipc_value   = 0;
     curenv->env_ipc_from    = 0;
     curenv->env_ipc_perm    = 0;
     curenv->env_ipc_recving = 1;
     curenv->env_ipc_dstva   = dstva;
-    curenv->env_status      = ENV_NOT_RUNNABLE;
+    // Envs that block waiting for messages are the interactive and
+    // server envs: let them run at their best level when woken.
+    sched_set_priority(curenv, curenv->env_prio_base);
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    if (timeout_us) {
+        t = env_timer(curenv);
+        timer_init(t, env_timeout, curenv);
+        timer_add(t, timeout_us);
+    }
+    spin_unlock(&ipc_lock);
 
     KDEBUG("\e[0;31m%08x blocked\e[0;00m\n", curenv->env_id);
 
     return 0;
 }
 
+// Set envid's base scheduling priority to 'prio', from 0 (highest) to
+// ENV_NPRIO-1, and move it to that level.  The scheduler will demote the
+// env below its base level while it is CPU bound, but never boost it
+// above.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//  -E_BAD_ENV if environment envid doesn't currently exist,
+//      or the caller doesn't have permission to change envid.
+//  -E_INVAL if prio is not a valid priority.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+    struct Env *e;
+    int res;
+
+    if(prio < 0 || prio >= ENV_NPRIO)
+        return -E_INVAL;
+
+    if((res = envid2env(envid, &e, 1)) < 0)
+        return res;
+
+    e->env_prio_base = prio;
+    sched_set_priority(e, prio);
+    return 0;
+}
+
+// Restrict envid to the CPUs in 'mask', bit n standing for CPU n.  The
+// env is moved off its current CPU at its next preemption if that CPU is
+// no longer allowed; a CPU running it elsewhere is sent a T_RESCHED so
+// that this comes soon even if it is tickless.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//  -E_BAD_ENV if environment envid doesn't currently exist,
+//      or the caller doesn't have permission to change envid.
+//  -E_INVAL if mask contains none of the CPUs in the system.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+    struct Env *e;
+    int res;
+
+    if(ncpu < 32)
+        mask &= (1 << ncpu) - 1;
+    if(mask == 0)
+        return -E_INVAL;
+
+    if((res = envid2env(envid, &e, 1)) < 0)
+        return res;
+
+    e->env_cpumask = mask;
+    // Requeue it in case it is waiting on a CPU it may no longer use.
+    if(e->env_status == ENV_RUNNABLE) {
+        sched_dequeue(e);
+        sched_enqueue(e);
+    } else if(e->env_status == ENV_RUNNING && e->env_cpunum != cpunum() &&
+              !((mask >> e->env_cpunum) & 1))
+        lapic_ipi_dest(cpus[e->env_cpunum].cpu_id, T_RESCHED);
+    return 0;
+}
+
+// Whether system call 'num' with arguments 'a1' and 'a2' always returns
+// to the caller without blocking or switching envs, and without looking
+// at the caller's env_tf.
+static bool
+syscall_noswitch(uint32_t num, uint32_t a1, uint32_t a2)
+{
+    switch(num) {
+        case SYS_cgetc:
+        case SYS_page_alloc:
+        case SYS_page_map:
+        case SYS_page_unmap:
+        case SYS_page_alloc_range:
+        case SYS_page_map_range:
+        case SYS_page_unmap_range:
+        case SYS_env_set_pgfault_upcall:
+        case SYS_ipc_try_send:
+        case SYS_env_recovered:
+        case SYS_region_reserve:
+        case SYS_env_set_priority:
+            return 1;
+
+        // Unless it stops the caller.
+        case SYS_env_set_status:
+            return a1 != 0 && a1 != curenv->env_id;
+
+        // Unless it pins the caller away from this CPU.
+        case SYS_env_set_affinity:
+            return (a1 != 0 && a1 != curenv->env_id) ||
+                ((a2 >> cpunum()) & 1);
+
+        default:
+            return 0;
+    }
+}
+
+// Whether call 'sb' would change the caller's mapping of a page that
+// holds part of the batch [calls, calls + n).
+static bool
+sys_batch_clobbers(struct SysBatch *sb, struct SysBatch *calls, size_t n)
+{
+    uint32_t envid, va, len = PGSIZE;
+
+    switch(sb->sb_num) {
+        case SYS_page_alloc:
+        case SYS_page_unmap:
+            envid = sb->sb_args[0];
+            va = sb->sb_args[1];
+            break;
+
+        case SYS_page_map:
+            envid = sb->sb_args[2];
+            va = sb->sb_args[3];
+            break;
+
+        case SYS_page_alloc_range:
+        case SYS_page_unmap_range:
+            envid = sb->sb_args[0];
+            va = sb->sb_args[1];
+            len = sb->sb_args[2];
+            break;
+
+        case SYS_page_map_range:
+            envid = sb->sb_args[1];
+            va = sb->sb_args[2];
+            len = sb->sb_args[3];
+            break;
+
+        default:
+            return 0;
+    }
+    // A bad range fails the call anyway.
+    return (envid == 0 || envid == curenv->env_id) &&
+           ROUNDDOWN(va, PGSIZE) < (uintptr_t) (calls + n) &&
+           ROUNDDOWN(va, PGSIZE) + len > (uintptr_t) calls;
+}
+
+// Run the n system calls described by calls[] in order, storing each
+// one's return value in its sb_ret.  The array is checked once, up
+// front.  Only calls that return straight to the caller may be
+// batched; others, and calls that would unmap or remap the array, fail
+// with -E_INVAL.  A call with SB_STOP set that fails ends the batch.
+//
+// Returns 0 if every call ran, or the error of the call that stopped
+// the batch.  Errors for the batch as a whole are:
+//  -E_INVAL if n is larger than SYSBATCH_MAX.
+//  -E_FAULT if calls[] is not writable user memory.
+static int
+sys_batch(struct SysBatch *calls, size_t n)
+{
+    struct SysBatch *sb;
+    int32_t r;
+
+    if(n > SYSBATCH_MAX)
+        return -E_INVAL;
+    if(user_mem_check(curenv, calls, n * sizeof(*calls), PTE_U | PTE_W) < 0)
+        return -E_FAULT;
+
+    for(sb = calls; sb < calls + n; sb++) {
+        if(!syscall_noswitch(sb->sb_num, sb->sb_args[0], sb->sb_args[1]) ||
+           sys_batch_clobbers(sb, calls, n))
+            r = -E_INVAL;
+        else
+            r = syscall(sb->sb_num, sb->sb_args[0], sb->sb_args[1],
+                        sb->sb_args[2], sb->sb_args[3], sb->sb_args[4]);
+        sb->sb_ret = r;
+        if(r < 0 && (sb->sb_flags & SB_STOP))
+            return r;
+    }
+    return 0;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -603,13 +1066,140 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
                                     (unsigned)  a4);
             
         case SYS_ipc_recv:
-            return sys_ipc_recv((void*) a1);
+            return sys_ipc_recv((void*)     a1,
+                                (uint32_t)  a2);
 
         case SYS_env_recovered:
             return sys_env_recovered();
 
+        case SYS_region_reserve:
+            return sys_region_reserve((envid_t) a1,
+                                      (void*)   a2,
+                                      (size_t)  a3,
+                                      (int)     a4);
+
+        case SYS_env_set_priority:
+            return sys_env_set_priority((envid_t) a1,
+                                        (int)     a2);
+
+        case SYS_env_set_affinity:
+            return sys_env_set_affinity((envid_t)   a1,
+                                        (uint32_t)  a2);
+
+        case SYS_sleep:
+            return sys_sleep((uint32_t) a1);
+
+        case SYS_batch:
+            return sys_batch((struct SysBatch *) a1,
+                             (size_t)            a2);
+
+        case SYS_page_alloc_range:
+            return sys_page_alloc_range((envid_t) a1,
+                                        (void*)   a2,
+                                        (size_t)  a3,
+                                        (int)     a4);
+
+        case SYS_page_map_range:
+            return sys_page_map_range((envid_t)  a1,
+                                      (envid_t)  a2,
+                                      (void*)    a3,
+                                      (size_t)   a4,
+                                      (uint32_t) a5);
+
+        case SYS_page_unmap_range:
+            return sys_page_unmap_range((envid_t) a1,
+                                        (void*)   a2,
+                                        (size_t)  a3);
+
+        case SYS_fork:
+            return sys_fork();
+
         default:
             return -E_INVAL;
     }
 }
 
+// Handle the system call in tf without the big kernel lock, if it only
+// touches the caller's own address space: sys_getenvid, sys_cputs, and
+// sys_page_alloc and sys_page_unmap on envid 0 or the caller.  These
+// rely on the finer locks (env_vm_lock, rmap_lock, page_lock and the
+// console lock) instead.
+//
+// Returns true with the result stored in tf if the call was handled,
+// false if the caller must take the kernel lock and use syscall().
+bool
+syscall_nolock(struct Trapframe *tf)
+{
+    uint32_t a1 = tf->tf_regs.reg_edx;
+    uint32_t a2 = tf->tf_regs.reg_ecx;
+    uint32_t a3 = tf->tf_regs.reg_ebx;
+    int32_t ret;
+
+    // A dying env has to go through trap() to be freed.
+    if(curenv->env_status != ENV_RUNNING)
+        return 0;
+
+    switch(tf->tf_regs.reg_eax) {
+        case SYS_getenvid:
+            ret = sys_getenvid();
+            break;
+
+        case SYS_cputs:
+            if(!sys_cputs_nolock((const char *) a1, (size_t) a2))
+                return 0;
+            ret = 0;
+            break;
+
+        case SYS_page_alloc:
+            if(a1 != 0 && a1 != curenv->env_id)
+                return 0;
+            ret = sys_page_alloc(0, (void *) a2, (int) a3);
+            break;
+
+        case SYS_page_unmap:
+            if(a1 != 0 && a1 != curenv->env_id)
+                return 0;
+            ret = sys_page_unmap(0, (void *) a2);
+            break;
+
+        default:
+            return 0;
+    }
+
+    tf->tf_regs.reg_eax = ret;
+    return 1;
+}
+
+// Handle the system call in tf under the big kernel lock without first
+// saving the caller's registers in env_tf, if it is one that never
+// blocks, never switches envs and never looks at the caller's env_tf.
+// Used by the sysenter path, which then returns with sysexit.
+//
+// Returns true with the result stored in tf if the call was handled,
+// false if the caller must go through trap().
+bool
+syscall_nosave(struct Trapframe *tf)
+{
+    struct PushRegs *r = &tf->tf_regs;
+
+    if(r->reg_eax != SYS_batch && !syscall_noswitch(r->reg_eax, r->reg_edx,
+                                                     r->reg_ecx))
+        return 0;
+
+    lock_kernel();
+    // A dying env has to go through trap() to be freed.
+    if(curenv->env_status != ENV_RUNNING) {
+        unlock_kernel();
+        return 0;
+    }
+    r->reg_eax = syscall(r->reg_eax, r->reg_edx, r->reg_ecx, r->reg_ebx,
+                         r->reg_edi, r->reg_esi);
+    // An env the call woke may be queued here, where sched_enqueue
+    // sends no IPI; without env_run, only we can start the tick.
+    if(thiscpu->cpu_tickless) {
+        sched_tick_start();
+        sched_timer_arm();
+    }
+    unlock_kernel();
+    return 1;
+}
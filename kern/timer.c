@@ -0,0 +1,231 @@
+/* See COPYRIGHT for copyright information. */
+
+// Hierarchical timer wheel.
+//
+// Pending timers hang off TW_LEVELS wheels of TW_SIZE slots each.  A
+// timer due less than TW_SIZE jiffies from now sits in level 0, in the
+// slot of its exact jiffy; one due within TW_SIZE^2 sits in level 1, in
+// a slot covering TW_SIZE jiffies; and so on.  Adding and cancelling are
+// O(1).  Whenever the current jiffy crosses a slot boundary of a level,
+// timer_run empties that level's next slot into the levels below it,
+// so every timer is moved at most TW_LEVELS - 1 times before it fires.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/timer.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define TW_BITS     6
+#define TW_SIZE     (1 << TW_BITS)
+#define TW_MASK     (TW_SIZE - 1)
+#define TW_LEVELS   4
+// Timers further out than this wait in the last level and are simply
+// re-filed when their slot comes round.
+#define TW_RANGE    ((1u << (TW_BITS * TW_LEVELS)) - 1)
+
+static struct Timer *tw_slots[TW_LEVELS][TW_SIZE];
+static uint32_t tw_now;             // Last jiffy timer_run processed
+static volatile uint32_t tw_count;  // Number of pending timers
+static volatile uint32_t tw_next;   // No timer is due before this jiffy
+
+// timer_lock protects the wheel and the timers on it.  It nests inside
+// every other lock: timer functions are called without it.
+static struct spinlock timer_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "timer_lock"
+#endif
+};
+
+//
+// The current jiffy.  Wraps after 49 days, so jiffies are compared by
+// their difference.
+//
+uint32_t
+timer_now(void)
+{
+    static_assert(TIMER_HZ == 1000);    // tsc_khz is TSC ticks per jiffy
+    return read_tsc() / tsc_khz;
+}
+
+//
+// File t in the wheel slot for its expiry.  A timer refiled just as it
+// comes due goes in the level 0 slot timer_run is about to empty.
+//
+static void
+tw_insert(struct Timer *t)
+{
+    uint32_t delta = t->t_expires - tw_now, when;
+    struct Timer **slot;
+    int level = 0;
+
+    if ((int32_t) delta <= 0)
+        when = tw_now;
+    else {
+        delta = MIN(delta, TW_RANGE);
+        while (level < TW_LEVELS - 1 && delta >= 1u << (TW_BITS * (level + 1)))
+            level++;
+        when = tw_now + delta;
+    }
+
+    slot = &tw_slots[level][(when >> (TW_BITS * level)) & TW_MASK];
+    t->t_next = *slot;
+    if (*slot)
+        (*slot)->t_pprev = &t->t_next;
+    *slot = t;
+    t->t_pprev = slot;
+}
+
+static void
+tw_unlink(struct Timer *t)
+{
+    if (t->t_next)
+        t->t_next->t_pprev = t->t_pprev;
+    *t->t_pprev = t->t_next;
+    t->t_pprev = NULL;
+}
+
+//
+// The earliest jiffy at which a timer may be due.  Exact when level 0
+// holds a timer; otherwise the start of the first non-empty slot of the
+// lowest non-empty level, which no timer in it precedes.
+//
+static uint32_t
+tw_next_due(void)
+{
+    int level, i, shift;
+
+    for (level = 0; level < TW_LEVELS; level++) {
+        shift = TW_BITS * level;
+        for (i = 1; i < TW_SIZE; i++)
+            if (tw_slots[level][((tw_now >> shift) + i) & TW_MASK])
+                return ((tw_now >> shift) + i) << shift;
+    }
+    return tw_now + TW_RANGE;
+}
+
+void
+timer_init(struct Timer *t, void (*fn)(void *), void *arg)
+{
+    t->t_next = NULL;
+    t->t_pprev = NULL;
+    t->t_fn = fn;
+    t->t_arg = arg;
+}
+
+//
+// Arm t to fire at least us microseconds from now, cancelling it first
+// if it is pending.
+//
+void
+timer_add(struct Timer *t, uint32_t us)
+{
+    uint32_t now = timer_now();
+
+    spin_lock(&timer_lock);
+    if (t->t_pprev) {
+        tw_unlink(t);
+        tw_count--;
+    }
+    // The wheel stops turning while it's empty.
+    if (!tw_count) {
+        tw_now = now;
+        tw_next = now + TW_RANGE;
+    }
+    // Round up, and count the jiffy we're part way through as nothing.
+    // In 64 bits, since that would wrap for 'us' near 2^32.
+    t->t_expires = now + 1 +
+        ((uint64_t) us + 1000000 / TIMER_HZ - 1) / (1000000 / TIMER_HZ);
+    tw_insert(t);
+    tw_count++;
+    if ((int32_t) (t->t_expires - tw_next) < 0)
+        tw_next = t->t_expires;
+    spin_unlock(&timer_lock);
+}
+
+//
+// Make sure t won't fire.  Cheap if it isn't pending.
+//
+void
+timer_cancel(struct Timer *t)
+{
+    // A timer is only armed and cancelled under the big kernel lock,
+    // so a timer seen idle here can't be on its way onto the wheel.
+    if (!t->t_pprev)
+        return;
+    spin_lock(&timer_lock);
+    if (t->t_pprev) {
+        tw_unlink(t);
+        tw_count--;
+    }
+    spin_unlock(&timer_lock);
+}
+
+//
+// Turn the wheel up to the current jiffy and call the functions of the
+// timers that came due.  Called from the timer interrupt.
+//
+void
+timer_run(void)
+{
+    struct Timer *expired = NULL, *t, *next;
+    uint32_t now = timer_now();
+    int level;
+
+    spin_lock(&timer_lock);
+    while (tw_count && (int32_t) (now - tw_now) > 0) {
+        tw_now++;
+
+        // Refile the next slot of each level whose boundary we crossed.
+        for (level = 1; level < TW_LEVELS; level++) {
+            if (tw_now & ((1u << (TW_BITS * level)) - 1))
+                break;
+            t = tw_slots[level][(tw_now >> (TW_BITS * level)) & TW_MASK];
+            tw_slots[level][(tw_now >> (TW_BITS * level)) & TW_MASK] = NULL;
+            for (; t; t = next) {
+                next = t->t_next;
+                tw_insert(t);
+            }
+        }
+
+        for (t = tw_slots[0][tw_now & TW_MASK]; t; t = next) {
+            next = t->t_next;
+            tw_unlink(t);
+            tw_count--;
+            t->t_next = expired;
+            expired = t;
+        }
+    }
+    if (!tw_count)
+        tw_now = now;
+    tw_next = tw_next_due();
+    spin_unlock(&timer_lock);
+
+    for (t = expired; t; t = next) {
+        next = t->t_next;
+        t->t_fn(t->t_arg);
+    }
+}
+
+//
+// Microseconds until the next timer may be due, at least 1 and at most
+// 0xFFFFFFFF, or 0 if no timer is pending.
+//
+uint32_t
+timer_next_us(void)
+{
+    uint64_t tsc = read_tsc();
+    uint32_t now = tsc / tsc_khz;
+    int32_t jiffies = tw_next - now;
+    uint64_t us;
+
+    if (!tw_count)
+        return 0;
+    if (jiffies <= 0)
+        return 1;
+    us = (uint64_t) jiffies * (1000000 / TIMER_HZ) -
+        tsc % tsc_khz * 1000 / tsc_khz;
+    return MIN(MAX(us, 1), 0xFFFFFFFF);
+}
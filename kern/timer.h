@@ -0,0 +1,31 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Kernel timers count in jiffies of 1ms, read off the TSC.
+#define TIMER_HZ    1000
+
+// A one-shot kernel timer.  t_fn(t_arg) is called from the timer
+// interrupt, with the big kernel lock held, some time after t_expires.
+struct Timer {
+    struct Timer *t_next;       // Next timer in the same wheel slot
+    struct Timer **t_pprev;     // Pointer to us in the slot; NULL if idle
+    uint32_t t_expires;         // Jiffy at which to fire
+    void (*t_fn)(void *arg);
+    void *t_arg;
+};
+
+uint32_t timer_now(void);
+void timer_init(struct Timer *t, void (*fn)(void *), void *arg);
+void timer_add(struct Timer *t, uint32_t us);
+void timer_cancel(struct Timer *t);
+void timer_run(void);
+uint32_t timer_next_us(void);
+
+#endif  // !JOS_KERN_TIMER_H
@@ -26,6 +26,10 @@ static int faultcount;
  */
 static struct Trapframe *last_tf;
 
+// The fast system call entry, and the end of the window in which it
+// may still run with the user's TF (kern/trapentry.S).
+extern char sysenter_entry[], sysenter_flags_clean[];
+
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
  */
@@ -64,6 +68,10 @@ static const char *trapname(int trapno)
         return excnames[trapno];
     if (trapno == T_SYSCALL)
         return "System call";
+    if (trapno == T_TLBFLUSH)
+        return "TLB shootdown";
+    if (trapno == T_RESCHED)
+        return "Reschedule";
     if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
         return "Hardware Interrupt";
     return "(unknown trap)";
@@ -97,6 +105,8 @@ trap_init(void)
     extern void mchk();
     extern void simderr();
     extern void system_call();
+    extern void tlbflush_ipi();
+    extern void resched_ipi();
 
     SETGATE(idt[T_DIVIDE], 0, GD_KT, divide, 0);  
     SETGATE(idt[T_DEBUG], 0, GD_KT, debug, 0);  
@@ -117,6 +127,8 @@ trap_init(void)
     SETGATE(idt[T_MCHK], 0, GD_KT, mchk, 0);  
     SETGATE(idt[T_SIMDERR], 0, GD_KT, simderr, 0);
     SETGATE(idt[T_SYSCALL], 0, GD_KT, system_call, 3);
+    SETGATE(idt[T_TLBFLUSH], 0, GD_KT, tlbflush_ipi, 0);
+    SETGATE(idt[T_RESCHED], 0, GD_KT, resched_ipi, 0);
 
     extern void irq0();
     extern void irq1();
@@ -196,6 +208,16 @@ trap_init_percpu(void)
     ltr(((GD_TSS0 >> 3) + cpunum()) << 3);
     // Load the IDT
     lidt(&idt_pd);
+
+    // Point sysenter at sysenter_entry, on this CPU's kernel stack.
+    // The user stub always uses it, so we can't do without.
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    if (!(edx & CPUID_FEAT_SEP))
+        panic("CPU %d does not support sysenter", cpunum());
+    wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+    wrmsr(MSR_IA32_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0);
+    wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_entry);
 }
 
 void
@@ -250,11 +272,6 @@ trap_dispatch(struct Trapframe *tf)
     // Handle processor exceptions.
     // LAB 3: Your code here.
     if(tf->tf_trapno == T_PGFLT){
-        if(curenv) {
-          curenv->env_fault_count++;
-        } if(curenv && curenv->env_fault_count > 5) {
-            panic("SHIT BE B0RKEN\n");
-        }
         page_fault_handler(tf);
     } else if(tf->tf_trapno == T_BRKPT){
         monitor(tf);
@@ -282,7 +299,27 @@ trap_dispatch(struct Trapframe *tf)
     // LAB 4: Your code here.
     else if(tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER){
         lapic_eoi();
-        sched_yield();
+        sched_tick();
+        return;
+    }
+
+    // Device interrupts also reach halted CPUs, in kernel mode.
+    else if(tf->tf_trapno == IRQ_OFFSET + IRQ_KBD){
+        lapic_eoi();
+        kbd_intr();
+        return;
+    }
+    else if(tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL){
+        lapic_eoi();
+        serial_intr();
+        return;
+    }
+
+    // A reschedule IPI only has to get a halted CPU into trap(), where
+    // the code below finds no curenv and calls sched_yield, or a tickless
+    // CPU back through env_run, which starts a tick.
+    else if(tf->tf_trapno == T_RESCHED){
+        lapic_eoi();
         return;
     }
 
@@ -314,9 +351,34 @@ trap(struct Trapframe *tf)
     // the interrupt path.
     assert(!(read_eflags() & FL_IF));
 
+    // TLB shootdowns are answered without the kernel lock: the CPU
+    // that sent this one may be holding it while it waits for us.
+    if (tf->tf_trapno == T_TLBFLUSH) {
+        lapic_eoi();
+        tlb_shootdown_poll();
+        env_pop_tf(tf);
+    }
+
+    // A user that enters sysenter with TF set single-steps through
+    // sysenter_entry until it loads clean flags.  Clear TF and carry on.
+    if (tf->tf_trapno == T_DEBUG && (tf->tf_cs & 3) == 0 &&
+        tf->tf_eip >= (uintptr_t) sysenter_entry &&
+        tf->tf_eip <= (uintptr_t) sysenter_flags_clean) {
+        tf->tf_eflags &= ~FL_TF;
+        env_pop_tf(tf);
+    }
+
+    // Re-acquire the big kernel lock if we were halted in sched_halt.
+    if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+        lock_kernel();
 
     if ((tf->tf_cs & 3) == 3) {
         // Trapped from user mode.
+        // System calls that only touch the caller's own address space
+        // run without the big kernel lock and return straight to it.
+        if (tf->tf_trapno == T_SYSCALL && syscall_nolock(tf))
+            env_pop_tf(tf);
+
         // Acquire the big kernel lock before doing any
         // serious kernel work.
         // LAB 4: Your code here.
@@ -354,6 +416,29 @@ trap(struct Trapframe *tf)
         sched_yield();
 }
 
+//
+// Called from sysenter_entry with the Trapframe it built.  Returns, for
+// sysenter_entry to go back to user mode with sysexit, if the system
+// call can be handled without saving the caller's registers in env_tf.
+// Anything that may block or switch envs goes through trap() instead.
+//
+void
+sysenter_trap(struct Trapframe *tf)
+{
+    uint32_t a5 = 0;
+
+    // The stub's %esi holds its return address, so the fifth argument,
+    // which only sys_page_map and sys_page_map_range take, is on the
+    // user stack.
+    if (tf->tf_regs.reg_eax == SYS_page_map ||
+        tf->tf_regs.reg_eax == SYS_page_map_range)
+        copyin(curenv, &a5, (const void *) tf->tf_esp, sizeof(a5));
+    tf->tf_regs.reg_esi = a5;
+
+    if (syscall_nolock(tf) || syscall_nosave(tf))
+        return;
+    trap(tf);
+}
 
 extern void _pgfault_upcall(void);
 
@@ -377,6 +462,17 @@ page_fault_handler(struct Trapframe *tf)
     // We've already handled kernel-mode exceptions, so if we get here,
     // the page fault happened in user mode.
 
+    // First touch of a page in a demand-zero region: map a zeroed page
+    // and retry the faulting instruction, without bothering the env.
+    if(!(tf->tf_err & FEC_PR) && env_region_fault(curenv, fault_va) == 0)
+        env_run(curenv);
+
+    // Write to a copy-on-write page: copy it, or just make it writable
+    // if nothing else maps it, and retry, again without an upcall.
+    if((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)
+       && env_cow_fault(curenv, fault_va) == 0)
+        env_run(curenv);
+
     // Call the environment's page fault upcall, if one exists.  Set up a
     // page fault stack frame on the user exception stack (below
     // UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -406,7 +502,7 @@ page_fault_handler(struct Trapframe *tf)
     //   (the 'tf' variable points at 'curenv->env_tf').
 
     // LAB 4: Your code here.
-    else if(curenv && curenv->env_pgfault_upcall) {
+    if(curenv && curenv->env_pgfault_upcall) {
         //cprintf("[page_fault_handler] User fault with upcall...\n"); 
         //print_trapframe(tf);
         //cprintf("[page_fault_handler] fault VA was %08x\n", fault_va);
@@ -414,6 +510,13 @@ page_fault_handler(struct Trapframe *tf)
         struct UTrapframe *utf;
         char*  raw_addr;
 
+        // Only faults the env has to handle itself count towards the
+        // limit that sys_env_recovered resets.
+        curenv->env_fault_count++;
+        if(curenv->env_fault_count > 5) {
+            panic("SHIT BE B0RKEN\n");
+        }
+
         if((UXSTACKTOP >= tf->tf_esp) && (UXSTACKTOP-PGSIZE <  tf->tf_esp)) {
             KT_DEBUG("recursive fault, adding an exception stack frame\n");
             raw_addr = (char*) tf->tf_esp - 4;
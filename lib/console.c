@@ -16,9 +16,10 @@ int
 getchar(void)
 {
     int r;
-    // sys_cgetc does not block, but getchar should.
+    // sys_cgetc does not block, but getchar should.  Nobody types
+    // faster than we poll.
     while ((r = sys_cgetc()) == 0)
-        sys_yield();
+        sys_sleep(10000);
     return r;
 }
 
@@ -1,15 +1,13 @@
-// implement fork from user space
+// fork, and the user-level handler for its copy-on-write pages
 
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW     0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
+// map in our own private writable copy.  The kernel copies on write
+// itself (see env_cow_fault), so this only sees the faults it couldn't
+// resolve.
 //
 static void
 pgfault(struct UTrapframe *utf)
@@ -33,14 +31,20 @@ pgfault(struct UTrapframe *utf)
     //   No need to explicitly delete the old page's mapping.
 
     // LAB 4: Your code here.
+        struct SysBatch calls[2];
+        size_t n = 0;
+        void *page = (void *) ROUNDDOWN(address, PGSIZE);
+
         if(sys_page_alloc(0, (void *) PFTEMP, PTE_W | PTE_U | PTE_P) < 0)
                     panic("pgfault failed!");
 
-        memmove(PFTEMP, (void *) ROUNDDOWN(address, PGSIZE), PGSIZE);
+        memmove(PFTEMP, page, PGSIZE);
 
-        if(sys_page_map(0, PFTEMP, 0, (void *) ROUNDDOWN(address, PGSIZE), PTE_W | PTE_U | PTE_P) < 0)
-            panic("pgfault failed!");
-        if(sys_page_unmap(0, (void *) PFTEMP) < 0)
+        // Move the copy into place in one trip to the kernel.
+        sysbatch_add(calls, &n, SYS_page_map, 0, (uint32_t) PFTEMP, 0,
+                     (uint32_t) page, PTE_W | PTE_U | PTE_P);
+        sysbatch_add(calls, &n, SYS_page_unmap, 0, (uint32_t) PFTEMP, 0, 0, 0);
+        if(sys_batch(calls, n) < 0)
             panic("pgfault failed!");
         return;
     }
@@ -49,146 +53,28 @@ pgfault(struct UTrapframe *utf)
 }
 
 //
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-    pte_t pte = vpt[pn];
-    void * address = (void *) (pn * PGSIZE);
-    int result;
-
-    if((pte & PTE_W) || (pte & PTE_COW)){
-        result = sys_page_map(0, address, envid, address, PTE_U | PTE_P | PTE_COW);
-        if(result < 0)
-                    panic("duppage failed!");
-        result = sys_page_map(0, address, 0, address, PTE_U | PTE_P | PTE_COW);
-                if (result < 0)
-                        panic("duppage failed!");
-        } else {
-                int result = sys_page_map(0, address, envid, address, PTE_U | PTE_P | PTE_COW);
-                if(result < 0)
-                    panic("[duppage] failed to handle page that is present but not writable or copy-on-write");
-        }
-       
-        return 0;
-}
-
-//
-// User-level fork with copy-on-write.
+// Fork with copy-on-write, done by the kernel.
 // Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Create a child whose address space is a copy-on-write copy of ours,
+// with our page fault handler setup, and return.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
 // It is also OK to panic on error.
 //
-// Hint:
-//   Use vpd, vpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
-//
 envid_t
 fork(void)
 {
-    // LAB 4: Your code here.
-    extern void _pgfault_upcall(void);
-    extern unsigned char end[];
-
-    // Set up our page fault handler appropriately.
-
-        // 1) The parent installs pgfault() as the C-level page fault handler.
-        set_pgfault_handler(pgfault);
-      
-    // 2) The parent calls sys_exofork() to create a child environment. 
-    envid_t envid = sys_exofork();
-
-        if(envid < 0){
-            panic("sys_exofork failed!");
-        }
-    // If child
-        else if(envid == 0){
-                thisenv = &envs[ENVX(sys_getenvid())];
-                return 0;
-        }
-
-    /**
-     * 3) For each writable or copy-on-write page in its address space below UTOP, the parent calls duppage,
-     * which should map the page copy-on-write into the address space of the child and then remap the page 
-     * copy-on-write in its own address space. duppage sets both PTEs so that the page is not writeable, 
-     * and to contain PTE_COW in the "avail" field to distinguish copy-on-write pages from genuine read-only pages.
-     *
-     * The exception stack is not remapped this way, however. Instead you need to allocate a fresh page in the child 
-     * for the exception stack. Since the page fault handler will be doing the actual copying and the page fault 
-     * handler runs on the exception stack, the exception stack cannot be made copy-on-write: who would copy it?
-     *
-     * fork() also needs to handle pages that are present, but not writable or copy-on-write.
-     */
-
-    uint32_t pdx, ptx, px;
-
-        // For each page directory entry from UTEXT TO UXSTACKTOP
-        for(pdx = PDX(UTEXT); pdx < PDX(UXSTACKTOP); pdx++){
-        // If the page table is present
-                if(vpd[pdx] & PTE_P){
-            // For each page table entry in this page table
-                        for(ptx = 0; ptx < NPTENTRIES; ptx++){
-                // Get page number field of this page table entry
-                                px = PGNUM(PGADDR(pdx, ptx, 0));
-
-                // Skip the exception stack.
-                                if(px >= PGNUM(UXSTACKTOP - PGSIZE)){
-                                    break;
-                                }
-
-                // If this page is present
-                                if(vpt[px] & PTE_P){
-                                    duppage(envid, px);
-                }
-                        }
-                }
-        }
-
-        // Allocate a fresh page in the child for an exception stack.
-        if(sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE), PTE_U | PTE_P | PTE_W) < 0){
-                panic("fork failed while allocating exception stack for child!");
-        }
-
-        // Map child's exception stack to a temporary page.
-        if(sys_page_map(envid, (void *) (UXSTACKTOP - PGSIZE), 0, UTEMP,
-           PTE_U | PTE_P | PTE_W) < 0){
-                panic("fork failed while mapping temporary page!");
-        }
-
-        // Copy this exception stack to temporary page.
-        memmove(UTEMP, (void *) (UXSTACKTOP - PGSIZE), PGSIZE);
-
-        // Unmap the temporary page.
-        if(sys_page_unmap(0, UTEMP) < 0){
-            panic("fork failed while unmapping temporary page!");
-        }
-
-    // 4) The parent sets the user page fault entrypoint for the child to look like its own.
-        if(sys_env_set_pgfault_upcall(envid, _pgfault_upcall) < 0){
-                panic("fork failed while trying to set user page fault entrypoint for the child to look like its own.");
-        }
+    envid_t envid;
 
-        // 5) The child is now ready to run, so the parent marks it as runnable.
-        if(sys_env_set_status(envid, ENV_RUNNABLE) < 0){
-        panic("fork failed while marking child env as runnable!");
-        }
+    // The child inherits our page fault upcall, and needs pgfault to
+    // copy its copy-on-write pages as much as we do.
+    set_pgfault_handler(pgfault);
 
-        return envid;
+    if ((envid = sys_fork()) < 0)
+        panic("sys_fork: %e", envid);
+    if (envid == 0)
+        thisenv = &envs[ENVX(sys_getenvid())];
+    return envid;
 }
 
 
@@ -3,6 +3,11 @@
 #include <inc/lib.h>
 #include <debug.h>
 
+// ipc_send yields to a receiver that isn't ready this many times, in
+// case it is about to call ipc_recv, before it sleeps between tries.
+#define IPC_SEND_YIELDS 8
+#define IPC_SEND_SLEEP  1000    // microseconds
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //  that address.
@@ -24,6 +29,15 @@ int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 {
     // LAB 4: Your code here.
+    return ipc_recv_timeout(from_env_store, pg, perm_store, 0);
+}
+
+// Like ipc_recv, but give up with -E_TIMEOUT if nothing arrives within
+// timeout_us microseconds.  A timeout of 0 waits forever.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+                 uint32_t timeout_us)
+{
     int32_t val;
     envid_t sender;
     int perm;
@@ -33,7 +47,7 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 
     IPC_DEBUG("making blocking call to ipc_recv\n");
 
-    if((val = sys_ipc_recv(pg)) < 0){
+    if((val = sys_ipc_recv(pg, timeout_us)) < 0){
         IPC_DEBUG("ipc_recv returned %e... dealing\n", val);
         sender = 0;
         perm = 0;
@@ -61,13 +75,14 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 // It should panic() on any error other than -E_IPC_NOT_RECV.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
+//   Use sys_yield() to be CPU-friendly.  A receiver still not ready
+//   after a few yields is waiting for something else, so sleep instead.
 //   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
-    int err;
+    int err, tries = 0;
 
     if(!pg && perm) {
       IPC_DEBUG("WTF man, you can't pass no page with permissions, squelshing permissions\n");
@@ -89,7 +104,10 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
             panic("ipc_send failed with error %e.\n", err);
         } else {
           IPC_DEBUG("try_send returned junk, sleeping\n");
-          sys_yield();
+          if(++tries <= IPC_SEND_YIELDS)
+              sys_yield();
+          else
+              sys_sleep(IPC_SEND_SLEEP);
         }
     }
 }
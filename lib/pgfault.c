@@ -28,7 +28,8 @@ set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
         // First time through!
         // LAB 4: Your code here.
     envid_t envid = sys_getenvid();
-        if(sys_page_alloc(0, (void *) (UXSTACKTOP - PGSIZE),  PTE_P | PTE_U | PTE_W) < 0)
+        // The kernel backs the stack when it first pushes a frame there.
+        if(sys_region_reserve(0, (void *) (UXSTACKTOP - PGSIZE), PGSIZE, PTE_P | PTE_U | PTE_W) < 0)
             panic("Unable to map a page for the user exception stack!\n");
         if(sys_env_set_pgfault_upcall(0, _pgfault_upcall) < 0)
             panic("Unable to set the user exception upcall!\n");    
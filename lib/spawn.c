@@ -4,6 +4,7 @@
 #define UTEMP2USTACK(addr)  ((void*) (addr) + (USTACKTOP - PGSIZE) - UTEMP)
 #define UTEMP2          (UTEMP + PGSIZE)
 #define UTEMP3          (UTEMP2 + PGSIZE)
+#define NBATCH          16      // map_segment's system call batch size
 
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
@@ -184,6 +185,8 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
     int argc, i, r;
     char *string_store;
     uintptr_t *argv_store;
+    struct SysBatch calls[2];
+    size_t n = 0;
 
     // Count the number of arguments (argc)
     // and the total amount of space needed for strings (string_size).
@@ -242,9 +245,10 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 
     // After completing the stack, map it into the child's address space
     // and unmap it from ours!
-    if ((r = sys_page_map(0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
-        goto error;
-    if ((r = sys_page_unmap(0, UTEMP)) < 0)
+    sysbatch_add(calls, &n, SYS_page_map, 0, (uint32_t) UTEMP, child,
+                 USTACKTOP - PGSIZE, PTE_P | PTE_U | PTE_W);
+    sysbatch_add(calls, &n, SYS_page_unmap, 0, (uint32_t) UTEMP, 0, 0, 0);
+    if ((r = sys_batch(calls, n)) < 0)
         goto error;
 
     return 0;
@@ -260,6 +264,8 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 {
     int i, r;
     void *blk;
+    struct SysBatch calls[NBATCH];
+    size_t n = 0;
 
     //cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -270,25 +276,42 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
         fileoffset -= i;
     }
 
-    for (i = 0; i < memsz; i += PGSIZE) {
-        if (i >= filesz) {
-            // allocate a blank page
-            if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-                return r;
-        } else {
-            // from file
-            if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-                return r;
-            if ((r = seek(fd, fileoffset + i)) < 0)
-                return r;
-            if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-                return r;
-            if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-                panic("spawn: sys_page_map data: %e", r);
-            sys_page_unmap(0, UTEMP);
-        }
+    // Leave the all-zero tail (bss) to the kernel's demand-zero faults,
+    // unless it shares a region slot or page with something else.
+    if (filesz < memsz) {
+        size_t zstart = ROUNDUP(filesz, PGSIZE);
+        if (zstart < memsz
+            && sys_region_reserve(child, (void*) (va + zstart), memsz - zstart, perm) == 0)
+            memsz = zstart;
     }
-    return 0;
+
+    // Queue the system calls up and make them in batches: each page
+    // read from the file costs one trip to the kernel, which moves the
+    // previous page into the child and allocates the next one.
+    for (i = 0; i < memsz && i < filesz; i += PGSIZE) {
+        if (n + 3 > NBATCH && (r = sysbatch_flush(calls, &n)) < 0)
+            return r;
+        sysbatch_add(calls, &n, SYS_page_alloc, 0, (uint32_t) UTEMP,
+                     PTE_P|PTE_U|PTE_W, 0, 0);
+        if ((r = sysbatch_flush(calls, &n)) < 0)
+            return r;
+        if ((r = seek(fd, fileoffset + i)) < 0)
+            return r;
+        if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
+            return r;
+        sysbatch_add(calls, &n, SYS_page_map, 0, (uint32_t) UTEMP,
+                     child, va + i, perm);
+        sysbatch_add(calls, &n, SYS_page_unmap, 0, (uint32_t) UTEMP,
+                     0, 0, 0);
+    }
+    // Allocate the blank pages left all at once.
+    if (i < memsz) {
+        if (n + 1 > NBATCH && (r = sysbatch_flush(calls, &n)) < 0)
+            return r;
+        sysbatch_add(calls, &n, SYS_page_alloc_range, child, va + i,
+                     ROUNDUP(memsz, PGSIZE) - i, perm, 0);
+    }
+    return sysbatch_flush(calls, &n);
 }
 
 
@@ -9,8 +9,10 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
     int32_t ret;
 
     // Generic system call: pass system call number in AX,
-    // up to five parameters in DX, CX, BX, DI, SI.
-    // Interrupt kernel with T_SYSCALL.
+    // up to four parameters in DX, CX, BX, DI, and the fifth on
+    // the stack.  Enter the kernel with sysenter, telling it
+    // where to come back to in SI and our stack pointer in BP.
+    // sysexit returns with those in DX and CX.
     //
     // The "volatile" tells the assembler not to optimize
     // this instruction away just because we don't use the
@@ -20,15 +22,20 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
     // potentially change the condition codes and arbitrary
     // memory locations.
 
-    asm volatile("int %1\n"
-        : "=a" (ret)
-        : "i" (T_SYSCALL),
-          "a" (num),
-          "d" (a1),
-          "c" (a2),
+    asm volatile("pushl %%ebp\n"
+        "pushl %%esi\n"
+        "movl %%esp, %%ebp\n"
+        "leal 1f, %%esi\n"
+        "sysenter\n"
+        "1: addl $4, %%esp\n"
+        "popl %%ebp\n"
+        : "=a" (ret),
+          "+d" (a1),
+          "+c" (a2),
+          "+S" (a5)
+        : "a" (num),
           "b" (a3),
-          "D" (a4),
-          "S" (a5)
+          "D" (a4)
         : "cc", "memory");
 
     if(check && ret > 0)
@@ -85,8 +92,33 @@ sys_page_unmap(envid_t envid, void *va)
     return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+    return syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_page_map_range(envid_t srcenv, envid_t dstenv, void *va, size_t len,
+                   uint32_t perm)
+{
+    return syscall(SYS_page_map_range, 1, srcenv, dstenv, (uint32_t) va, len, perm);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+    return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, len, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+    return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -112,9 +144,15 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 }
 
 int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t timeout_us)
 {
-    return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+    return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, timeout_us, 0, 0, 0);
+}
+
+int
+sys_sleep(uint32_t us)
+{
+    return syscall(SYS_sleep, 0, us, 0, 0, 0, 0);
 }
 
 int
@@ -140,3 +178,55 @@ sys_env_recovered()
 {
     return syscall(SYS_env_recovered, 0, 0, 0, 0, 0, 0);
 }
+
+int
+sys_region_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+    return syscall(SYS_region_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+    return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+    return syscall(SYS_env_set_affinity, 1, envid, mask, 0, 0, 0);
+}
+
+int
+sys_batch(struct SysBatch *calls, size_t n)
+{
+    return syscall(SYS_batch, 0, (uint32_t) calls, n, 0, 0, 0);
+}
+
+// Append system call 'num' to the batch calls[0..*n), to stop the batch
+// if it fails.
+void
+sysbatch_add(struct SysBatch *calls, size_t *n, uint32_t num,
+             uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+    struct SysBatch *sb = &calls[(*n)++];
+
+    sb->sb_num = num;
+    sb->sb_flags = SB_STOP;
+    sb->sb_args[0] = a1;
+    sb->sb_args[1] = a2;
+    sb->sb_args[2] = a3;
+    sb->sb_args[3] = a4;
+    sb->sb_args[4] = a5;
+    sb->sb_ret = 0;
+}
+
+// Run the batch calls[0..*n), if any, and empty it.
+int
+sysbatch_flush(struct SysBatch *calls, size_t *n)
+{
+    int r = *n ? sys_batch(calls, *n) : 0;
+
+    *n = 0;
+    return r;
+}
@@ -1,6 +1,6 @@
 // Demonstrate lack of fairness in IPC.
 // Start three instances of this program as envs 1, 2, and 3.
-// (user/idle is env 0).
+// (the file system server is env 0).
 
 #include <inc/lib.h>
 
@@ -0,0 +1,79 @@
+// Scheduler fairness and load balancing benchmark.
+// Forks NCHILD CPU-bound children that alternate between a burst of
+// work and sys_yield, like stresssched.  Each child tallies which CPU it
+// found itself on after every yield; the parent samples env_runs of all
+// children once the first one finishes, to show how evenly they were
+// served.  Run with CPUS=n.
+
+#include <inc/lib.h>
+
+#define NCHILD  12
+#define ROUNDS  200
+#define WORK    20000
+#define MAXCPU  8
+
+volatile int sink;
+
+static void
+child(void)
+{
+    uint32_t oncpu[MAXCPU];
+    int i, j, cpu, last = -1, migrations = 0;
+
+    memset(oncpu, 0, sizeof(oncpu));
+    for (i = 0; i < ROUNDS; i++) {
+        sys_yield();
+        cpu = thisenv->env_cpunum;
+        if (cpu < MAXCPU)
+            oncpu[cpu]++;
+        if (last >= 0 && cpu != last)
+            migrations++;
+        last = cpu;
+        for (j = 0; j < WORK; j++)
+            sink++;
+    }
+
+    cprintf("[%08x] schedbench runs %u migrations %d cpus",
+            thisenv->env_id, thisenv->env_runs, migrations);
+    for (i = 0; i < MAXCPU; i++)
+        if (oncpu[i])
+            cprintf(" %d:%u", i, oncpu[i]);
+    cprintf("\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+    envid_t kids[NCHILD];
+    uint32_t runs, min = ~0, max = 0, total = 0;
+    int i, done;
+
+    for (i = 0; i < NCHILD; i++) {
+        if ((kids[i] = fork()) < 0)
+            panic("fork: %e", kids[i]);
+        if (kids[i] == 0) {
+            child();
+            return;
+        }
+    }
+
+    // Wait for the first child to finish, then see how far behind the
+    // others are.
+    for (done = 0; !done; sys_yield())
+        for (i = 0; i < NCHILD; i++)
+            if (envs[ENVX(kids[i])].env_id != kids[i] ||
+                envs[ENVX(kids[i])].env_status == ENV_FREE)
+                done = 1;
+
+    for (i = 0; i < NCHILD; i++) {
+        if (envs[ENVX(kids[i])].env_id != kids[i])
+            runs = ROUNDS;
+        else
+            runs = envs[ENVX(kids[i])].env_runs;
+        min = MIN(min, runs);
+        max = MAX(max, runs);
+        total += runs;
+    }
+    cprintf("schedbench fairness: runs min %u max %u avg %u\n",
+            min, max, total / NCHILD);
+}
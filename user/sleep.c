@@ -0,0 +1,33 @@
+// Test sys_sleep and ipc_recv_timeout.  The parent sleeps, then waits for
+// a message that never comes and must time out, then waits for one its
+// child sends after a sleep of its own.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+    envid_t child, who;
+    int32_t r;
+
+    sys_sleep(20000);
+    cprintf("slept\n");
+
+    r = ipc_recv_timeout(&who, 0, 0, 20000);
+    if (r != -E_TIMEOUT)
+        panic("ipc_recv_timeout with no sender returned %e", r);
+    cprintf("ipc_recv timed out\n");
+
+    if ((child = fork()) < 0)
+        panic("fork: %e", child);
+    if (child == 0) {
+        sys_sleep(10000);
+        ipc_send(thisenv->env_parent_id, 0x5eed, 0, 0);
+        return;
+    }
+
+    r = ipc_recv_timeout(&who, 0, 0, 10000000);
+    if (r != 0x5eed || who != child)
+        panic("ipc_recv_timeout got %e from %08x", r, who);
+    cprintf("ipc_recv woken before its timeout\n");
+}
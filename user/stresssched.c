@@ -20,7 +20,7 @@ umain(int argc, char **argv)
 
     // Wait for the parent to finish forking
     while (envs[ENVX(parent)].env_status != ENV_FREE)
-        asm volatile("pause");
+        sys_sleep(1000);
 
     // Check that one environment doesn't run on two CPUs at once
     for (i = 0; i < 10; i++) {